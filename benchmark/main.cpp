@@ -0,0 +1,60 @@
+// © Joseph Cameron - All Rights Reserved
+
+#include <jfc/lua.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+using namespace jfc::lua;
+
+/// \brief constructs aCount interpreters with the given options, reports time and memory per interpreter
+static void construction(const std::string &aName, const interpreter::options &aOptions, const size_t aCount)
+{
+    size_t memory(0);
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (size_t i(0); i < aCount; ++i)
+    {
+        interpreter interp(aOptions);
+
+        memory += interp.memory_usage();
+    }
+
+    const std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << aName << ": " << elapsed.count() / aCount << " us, " 
+        << memory / aCount << " bytes per interpreter\n";
+}
+
+int main(int argc, char *argv[])
+{
+    const size_t count(argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000);
+
+    using library = interpreter::library;
+
+    const std::vector<library> all = { library::base, library::package, library::table, library::string, 
+        library::math, library::io, library::os, library::debug, library::bit, library::jit };
+
+    interpreter::options none;
+
+    interpreter::options everything;
+    everything.libraries = all;
+
+    interpreter::options selected;
+    selected.libraries = { library::base, library::table, library::string, library::math };
+
+    interpreter::options lazy;
+    lazy.libraries = { library::base };
+    lazy.lazy_libraries = { library::package, library::table, library::string, library::math, library::io, 
+        library::os, library::debug, library::bit, library::jit };
+
+    construction("no libraries", none, count);
+    construction("all libraries", everything, count);
+    construction("selected libraries", selected, count);
+    construction("base, others lazy", lazy, count);
+
+    return EXIT_SUCCESS;
+}
@@ -3,19 +3,31 @@
 #ifndef JFC_LUA_H
 #define JFC_LUA_H
 
+#include <array>
+#include <cmath>
+#include <cstdint>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <list>
 #include <map>
 #include <memory>
 #include <optional>
+#include <tuple>
+#include <type_traits>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
 #include <variant>
+#include <vector>
 
 struct lua_State;
 
 namespace jfc::lua
 {
+    class table_pool;
+
     /// \brief datamodel type for table.
     ///
     /// can be used to: send messages between interpeters, serialize state to disk,
@@ -31,6 +43,10 @@ namespace jfc::lua
         /// \brief construct a table from an existing table within a lua state
         table(lua_State *L, int aIndex);
 
+        /// \brief construct a table from an existing table within a lua state, sharing
+        /// subtables with any structurally identical subtables already in aPool
+        table(lua_State *L, int aIndex, table_pool &aPool);
+
         /// \brief construct a table with no content
         table() = default;
 
@@ -40,7 +56,24 @@ namespace jfc::lua
         /// \brief writes the table to a lua state
         void push_to_lua_state(lua_State *L) const;
 
+        /// \brief serialize to a string, as operator<< does, using aThreadCount threads.
+        ///
+        /// runs of fields and large subtables are encoded in parallel then joined in order,
+        /// so the result is identical to operator<<. 0 uses up to one thread per core. No more threads
+        /// are started than there are pieces of work, and small tables are encoded on the calling thread
+        [[nodiscard]] std::string to_string(size_t aThreadCount = 0) const;
+
+        /// \brief structural hash, computed once at construction
+        [[nodiscard]] size_t hash() const;
+
+        /// \brief structural equality. Tables with different hashes compare unequal without
+        /// visiting their fields, and pooled subtables compare equal by identity
+        friend bool operator==(const table &a, const table &b);
+        friend bool operator!=(const table &a, const table &b);
+
     private:
+        friend class shared_table;
+
         using value_type = std::variant<double, bool, std::string, std::shared_ptr<table>>;
 
         /// \brief ordered map of number key fields
@@ -51,21 +84,436 @@ namespace jfc::lua
         
         /// \brief unordered map of bool key fields
         std::unordered_map<bool, value_type> m_BooleanFields;
+
+        /// \brief cached structural hash of the fields
+        size_t m_Hash = 0;
+
+        /// \brief construct from a lua state, interning subtables if pPool is not null
+        table(lua_State *L, int aIndex, table_pool *pPool);
+
+        /// \brief structural hash of the fields
+        [[nodiscard]] size_t compute_hash() const;
+
+        /// \brief converts a subtable, returning the pooled copy if pPool is not null
+        static std::shared_ptr<table> make_subtable(lua_State *L, int aIndex, table_pool *pPool);
+    };
+
+    /// \brief opt-in storage of structurally unique tables.
+    ///
+    /// tables constructed with a pool share a single copy of every repeated subtable (and the
+    /// strings inside it), so repetitive data costs memory and copy time once per unique subtree
+    class table_pool final
+    {
+    public:
+        /// \brief returns the pooled table equal to aTable, adding aTable if there is none
+        [[nodiscard]] std::shared_ptr<table> intern(table &&aTable);
+
+        /// \brief number of unique tables in the pool
+        [[nodiscard]] size_t size() const;
+
+        /// \brief releases the pool's references; tables already built keep their shared subtables
+        void clear();
+
+    private:
+        /// \brief unique tables by structural hash
+        std::unordered_multimap<size_t, std::shared_ptr<table>> m_Tables;
+    };
+
+    /// \brief an immutable table stored once in c++ memory and shared by any number of interpreters
+    ///
+    /// interpreters see it as a read-only userdata whose __index, __len and __pairs read the shared
+    /// memory directly, so memory scales with the data rather than with the number of interpreters.
+    /// Immutable once constructed, so interpreters on different threads may read it concurrently.
+    ///
+    /// \note lua 5.1 ignores __pairs unless luajit is built with LUAJIT_ENABLE_LUA52COMPAT;
+    /// `for k, v in t() do` iterates in either case
+    class shared_table final
+    {
+    public:
+        /// \brief pushes a read-only proxy of this table to a lua state
+        static void push_to_lua_state(lua_State *L, const std::shared_ptr<const shared_table> &aTable);
+
+        /// \brief copy the content of a table into compact shared storage
+        explicit shared_table(const table &aTable);
+
+    private:
+        /// \brief a key or value
+        struct value_type final
+        {
+            enum class kind : std::uint8_t { boolean, number, string, table } type;
+
+            /// \brief a range of m_Strings
+            struct string_range final { std::uint32_t offset, size; };
+
+            union
+            {
+                bool boolean;
+                double number;
+                string_range string;
+                std::uint32_t table;
+            };
+        };
+
+        /// \brief a (sub)table: a sequence for keys [1..n] and key-sorted entries for all other keys
+        struct node_type final
+        {
+            std::uint32_t array_offset, array_size;
+            std::uint32_t entry_offset, entry_size;
+        };
+
+        /// \brief appends aTable and its subtables, returns the index of its node
+        std::uint32_t add_node(const table &aTable);
+
+        /// \brief converts a field of a table, adding subtables and strings
+        value_type add_value(const table::value_type &aValue);
+
+        /// \brief adds a string to m_Strings
+        value_type add_string(const std::string &aValue);
+
+        friend struct shared_table_access;
+
+        /// \brief all tables; the root is m_Nodes[0]
+        std::vector<node_type> m_Nodes;
+
+        /// \brief values of the sequence parts of all tables
+        std::vector<value_type> m_Arrays;
+
+        /// \brief key, value pairs of the non-sequence parts of all tables
+        std::vector<std::pair<value_type, value_type>> m_Entries;
+
+        /// \brief characters of all strings
+        std::string m_Strings;
     };
 
     /// \brief parameter list for functions that commuicate across c++/lua barrier
     using params_type = std::vector<std::variant<double, bool, std::string, decltype(nullptr), table>>;
 
+    /// \brief describes a member of a struct for struct_fields
+    template<class struct_type, class member_type>
+    struct field final
+    {
+        /// \brief name of the field in the lua table
+        const char *name;
+
+        /// \brief the member the field is read from and written to
+        member_type struct_type::*member;
+    };
+
+    /// \brief creates a field descriptor
+    template<class struct_type, class member_type>
+    constexpr field<struct_type, member_type> make_field(const char *aName, member_type struct_type::*aMember)
+    {
+        return {aName, aMember};
+    }
+
+    /// \brief describes a member using its own name as the field name
+    #define JFC_LUA_FIELD(aStruct, aMember) ::jfc::lua::make_field(#aMember, &aStruct::aMember)
+
+    /// \brief specialize to make a struct convertible to and from a lua table
+    ///
+    /// the specialization must have a static constexpr tuple of fields named value, e.g:
+    /// template<> struct jfc::lua::struct_fields<vec2>
+    /// { 
+    ///     static constexpr auto value = std::make_tuple(JFC_LUA_FIELD(vec2, x), JFC_LUA_FIELD(vec2, y));
+    /// };
+    ///
+    /// members may be [bool, arithmetic, string, table], structs with struct_fields, or std::vectors of these
+    template<class struct_type>
+    struct struct_fields;
+
+    /// \brief lua api used by the struct conversion templates, so that this header does not depend on lua
+    namespace detail
+    {
+        void create_table(lua_State *L, int aArraySize, int aRecordSize);
+        void push_boolean(lua_State *L, bool aValue);
+        void push_number(lua_State *L, double aValue);
+        void push_string(lua_State *L, const std::string &aValue);
+        /// \brief pops a value, assigning it to a field of the table below it
+        void set_field(lua_State *L, const char *aName);
+        /// \brief pops a value, assigning it to an index of the table below it
+        void set_index(lua_State *L, int aIndex);
+        /// \brief pushes a field of the table at aTable
+        void get_field(lua_State *L, int aTable, const char *aName);
+        /// \brief pushes an index of the table at aTable
+        void get_index(lua_State *L, int aTable, int aIndex);
+        void pop(lua_State *L, int aCount);
+        [[nodiscard]] int top(lua_State *L);
+        [[nodiscard]] bool is_table(lua_State *L, int aIndex);
+        [[nodiscard]] size_t length(lua_State *L, int aIndex);
+        [[nodiscard]] bool to_boolean(lua_State *L, int aIndex, bool &aValue);
+        [[nodiscard]] bool to_number(lua_State *L, int aIndex, double &aValue);
+        [[nodiscard]] bool to_string(lua_State *L, int aIndex, std::string &aValue);
+
+        /// \brief pcall message handler that records the failing call stack into the error at upvalue 1
+        int error_handler(lua_State *L);
+
+        template<class type>
+        struct is_vector : std::false_type {};
+
+        template<class type, class allocator_type>
+        struct is_vector<std::vector<type, allocator_type>> : std::true_type {};
+
+        template<class type, class = void>
+        struct has_struct_fields : std::false_type {};
+
+        template<class type>
+        struct has_struct_fields<type, std::void_t<decltype(struct_fields<type>::value)>> : std::true_type {};
+
+        template<class type>
+        inline constexpr bool always_false_v = false;
+    }
+
+    /// \brief pushes a value onto the lua stack, converting structs and vectors to presized tables
+    template<class value_type>
+    void push_struct(lua_State *L, const value_type &aValue)
+    {
+        if constexpr (std::is_same_v<value_type, bool>) detail::push_boolean(L, aValue);
+        else if constexpr (std::is_arithmetic_v<value_type>) detail::push_number(L, static_cast<double>(aValue));
+        else if constexpr (std::is_same_v<value_type, std::string>) detail::push_string(L, aValue);
+        else if constexpr (std::is_same_v<value_type, table>) aValue.push_to_lua_state(L);
+        else if constexpr (detail::is_vector<value_type>::value)
+        {
+            detail::create_table(L, static_cast<int>(aValue.size()), 0);
+
+            for (size_t i(0); i < aValue.size(); ++i)
+            {
+                // explicit element type, as std::vector<bool> returns a proxy
+                push_struct<typename value_type::value_type>(L, aValue[i]);
+                detail::set_index(L, static_cast<int>(i + 1));
+            }
+        }
+        else if constexpr (detail::has_struct_fields<value_type>::value)
+        {
+            constexpr auto &fields = struct_fields<value_type>::value;
+
+            detail::create_table(L, 0, static_cast<int>(std::tuple_size_v<std::decay_t<decltype(fields)>>));
+
+            std::apply([L, &aValue](const auto &...field)
+            {
+                ((push_struct(L, aValue.*(field.member)), detail::set_field(L, field.name)), ...);
+            }, fields);
+        }
+        else static_assert(detail::always_false_v<value_type>, "push_struct: unsupported type");
+    }
+
+    /// \brief reads a value from the lua stack, converting tables to structs and vectors
+    ///
+    /// returns false if the value or any of its fields are missing or of the wrong type, or if a
+    /// number read into an integral member is not a whole number in the member's range.
+    /// aValue may be partially assigned if false is returned
+    template<class value_type>
+    [[nodiscard]] bool read_struct(lua_State *L, int aIndex, value_type &aValue)
+    {
+        if (aIndex < 0) aIndex = detail::top(L) + aIndex + 1;
+
+        if constexpr (std::is_same_v<value_type, bool>) return detail::to_boolean(L, aIndex, aValue);
+        else if constexpr (std::is_arithmetic_v<value_type>)
+        {
+            double number;
+
+            if (!detail::to_number(L, aIndex, number)) return false;
+
+            if constexpr (std::is_integral_v<value_type>)
+            {
+                // bounds are powers of two, so exact as doubles; NaN fails every comparison
+                constexpr double lowest(static_cast<double>(std::numeric_limits<value_type>::min()));
+                constexpr double limit(static_cast<double>(std::numeric_limits<value_type>::max() / 2 + 1) * 2);
+
+                if (!(number >= lowest && number < limit) || std::trunc(number) != number) return false;
+            }
+
+            aValue = static_cast<value_type>(number);
+
+            return true;
+        }
+        else if constexpr (std::is_same_v<value_type, std::string>) return detail::to_string(L, aIndex, aValue);
+        else if constexpr (std::is_same_v<value_type, table>)
+        {
+            if (!detail::is_table(L, aIndex)) return false;
+
+            aValue = table(L, aIndex);
+
+            return true;
+        }
+        else if constexpr (detail::is_vector<value_type>::value)
+        {
+            if (!detail::is_table(L, aIndex)) return false;
+
+            const size_t size(detail::length(L, aIndex));
+
+            aValue.resize(size);
+
+            for (size_t i(0); i < size; ++i)
+            {
+                detail::get_index(L, aIndex, static_cast<int>(i + 1));
+
+                // read into an element rather than aValue[i], which is a proxy for std::vector<bool>
+                typename value_type::value_type element{};
+
+                const bool ok(read_struct(L, -1, element));
+
+                detail::pop(L, 1);
+
+                if (!ok) return false;
+
+                aValue[i] = std::move(element);
+            }
+
+            return true;
+        }
+        else if constexpr (detail::has_struct_fields<value_type>::value)
+        {
+            if (!detail::is_table(L, aIndex)) return false;
+
+            return std::apply([L, aIndex, &aValue](const auto &...field)
+            {
+                return ([L, aIndex, &aValue](const auto &field)
+                {
+                    detail::get_field(L, aIndex, field.name);
+
+                    const bool ok(read_struct(L, -1, aValue.*(field.member)));
+
+                    detail::pop(L, 1);
+
+                    return ok;
+                }(field) && ...);
+            }, struct_fields<value_type>::value);
+        }
+        else static_assert(detail::always_false_v<value_type>, "read_struct: unsupported type");
+    }
+
+    /// \brief an error raised while loading or running lua, or by a registered function
+    ///
+    /// records the message and the lua call stack at the point of failure into fixed storage,
+    /// without formatting them; strings are only built when message() or traceback() is called
+    class error final
+    {
+    public:
+        /// \brief a lua function on the call stack when the error was raised
+        struct frame_type final
+        {
+            /// \brief chunk the function was defined in
+            std::array<char, 60> source;
+
+            /// \brief line being executed, -1 if unknown (eg in a c function)
+            int line;
+        };
+
+        /// \brief the error message, including the location lua prefixed it with.
+        ///
+        /// messages longer than message_capacity are truncated
+        [[nodiscard]] std::string message() const;
+
+        /// \brief the innermost recorded lua frame, null if there is none (eg a syntax error)
+        [[nodiscard]] const frame_type *location() const;
+
+        /// \brief formats the recorded frames, innermost first
+        [[nodiscard]] std::string traceback() const;
+
+        /// \brief writes the message
+        friend std::ostream &operator<<(std::ostream &stream, const error &a);
+
+        /// \brief an error with a message and no recorded frames
+        error(std::string_view aMessage);
+
+        /// \brief maximum number of characters of the message kept
+        static constexpr size_t message_capacity = 512;
+
+    private:
+        friend int detail::error_handler(lua_State *L);
+
+        /// \brief maximum number of frames recorded
+        static constexpr size_t frame_capacity = 16;
+
+        /// \brief characters of the message, not null terminated
+        std::array<char, message_capacity> m_Message;
+
+        size_t m_MessageSize = 0;
+
+        std::array<frame_type, frame_capacity> m_Frames;
+
+        size_t m_FrameCount = 0;
+    };
+
+    class environment;
+
     /// \brief a lua interpreter
     class interpreter final
     {
     public:
         /// \brief methods that can fail return this
-        using error_type = std::optional<std::string>;
+        using error_type = std::optional<error>;
 
         /// \brief c++'s implementation of the closure is a lambda with a non-empty capture list
         using closure_type = std::function<params_type(params_type)>;
 
+        /// \brief invoked with the path of a field each time it is assigned in a watched table
+        using watch_callback_type = std::function<void(const std::string &)>;
+
+        /// \brief a value that can be read from or written to a path in the lua context
+        using value_type = std::variant<bool, double, std::string, table>;
+
+        /// \brief standard libraries an interpreter can open
+        enum class library
+        {
+            base,
+            package,
+            table,
+            string,
+            math,
+            io,
+            os,
+            debug,
+            bit,
+            jit
+        };
+
+        /// \brief what to load when constructing an interpreter
+        struct options final
+        {
+            /// \brief libraries opened during construction
+            std::vector<library> libraries;
+
+            /// \brief libraries opened the first time their global is read.
+            ///
+            /// base is always opened during construction, as it has no single global to trigger on.
+            /// A lazy string library is also opened by the first string method call, eg s:format()
+            std::vector<library> lazy_libraries;
+
+            /// \brief lua source of modules made available to require, by module name.
+            ///
+            /// the package library is opened during construction if this is not empty
+            std::unordered_map<std::string, std::string> preload;
+        };
+
+        /// \brief a list of writes to be applied to the lua context in a single traversal
+        ///
+        /// writes are applied in insertion order; consecutive paths that share a prefix resolve that prefix once
+        class write_batch final
+        {
+        public:
+            /// \brief adds a [string, boolean] write to the batch
+            write_batch &write_value(const std::string &aPath, const bool aValue);
+            /// \brief adds a [string, number] write to the batch
+            write_batch &write_value(const std::string &aPath, const double aValue);
+            /// \brief adds a [string, string] write to the batch
+            write_batch &write_value(const std::string &aPath, const std::string &aValue);
+            /// \brief adds a [string, string] write to the batch
+            write_batch &write_value(const std::string &aPath, const std::string::value_type *aValue);
+            /// \brief adds a [string, table] write to the batch
+            write_batch &write_value(const std::string &aPath, const table &aValue);
+
+            /// \brief number of writes in the batch
+            [[nodiscard]] size_t size() const;
+
+        private:
+            friend class interpreter;
+            friend class environment;
+
+            /// \brief path, value pairs in insertion order
+            std::vector<std::pair<std::string, value_type>> m_Writes;
+        };
+
         /// \brief writes a [string, boolean] to the lua context
         void write_value(const std::string &aPath, const bool aValue);
         /// \brief writes a [string, number] to the lua context
@@ -76,6 +524,24 @@ namespace jfc::lua
         void write_value(const std::string &aPath, const std::string::value_type *aValue);
         /// \brief writes a [string, table] to the lua context
         void write_value(const std::string &aPath, const table &);
+        /// \brief writes a read-only proxy of a shared table to the lua context
+        ///
+        /// paths can be read through the proxy; writing to a path through it throws std::invalid_argument
+        void write_value(const std::string &aPath, const std::shared_ptr<const shared_table> &aValue);
+        /// \brief applies all writes in the batch to the lua context
+        ///
+        /// throws std::invalid_argument at the first write whose path passes through a shared_table;
+        /// the writes before it have been applied
+        void write_values(const write_batch &aBatch);
+        /// \brief writes a struct with struct_fields (or a vector of them) to the lua context as a table
+        template<class struct_type>
+        void write_struct(const std::string &aPath, const struct_type &aValue)
+        {
+            write_pushed(aPath, [](lua_State *L, const void *p)
+            {
+                push_struct(L, *static_cast<const struct_type *>(p));
+            }, &aValue);
+        }
         
         /*
         /// \brief writes a [boolean, boolean] to the lua context
@@ -120,15 +586,83 @@ namespace jfc::lua
         [[nodiscard]] std::optional<std::string> read_string(const std::string &aPath) const;
         /// \brief reads a table from the lua context
         [[nodiscard]] std::optional<table> read_table(const std::string &aPath) const;
+        /// \brief reads a table from the lua context, sharing identical subtables through aPool
+        [[nodiscard]] std::optional<table> read_table(const std::string &aPath, table_pool &aPool) const;
+        /// \brief reads a struct with struct_fields (or a vector of them) from the lua context
+        template<class struct_type>
+        [[nodiscard]] std::optional<struct_type> read_struct(const std::string &aPath) const
+        {
+            std::optional<struct_type> value(struct_type{});
+
+            if (!read_with(aPath, [](lua_State *L, int aIndex, void *p)
+            {
+                return jfc::lua::read_struct(L, aIndex, *static_cast<struct_type *>(p));
+            }, &*value)) value.reset();
+
+            return value;
+        }
+        /// \brief reads many values in a single traversal of the lua context
+        ///
+        /// results are in the same order as aPaths. A result is empty if the path does not exist
+        /// or the value is not one of [boolean, number, string, table]
+        [[nodiscard]] std::vector<std::optional<value_type>> read_values(const std::vector<std::string> &aPaths) const;
         /// \brief reads a value of unknown type
         //[[nodiscard]] std::optional<std::variant<bool, double, std::string, table> read_any(const std::string &aPath) const;
 
-        //TODO: calls a lua function if it exists: use for eg callbacks
-        //[[nodiscard]] std::optional<return_list> call_function(const std::string &aPath, param_list_type params);
+        /// \brief calls a lua function if it exists: use for eg callbacks
+        ///
+        /// returns empty if there is no function at aPath, the call raised an error or a return value
+        /// is not one of [nil, boolean, number, string, table]. In the last two cases the error is
+        /// assigned to *pError if it is not null, so it is left empty only if there was no function.
+        /// Results of memoized functions come from the cache when the same arguments have been seen before
+        [[nodiscard]] std::optional<params_type> call_function(const std::string &aPath, const params_type &aParams,
+            error_type *pError = nullptr);
+
+        /// \brief marks the function at aPath as pure, caching up to aCapacity results of call_function
+        ///
+        /// the least recently used result is evicted when the cache is full. The cache is cleared
+        /// when the global at aPath is assigned a different function
+        void memoize(const std::string &aPath, const size_t aCapacity = 256);
+
+        /// \brief stops caching results of the function at aPath
+        void unmemoize(const std::string &aPath);
+
+        /// \brief counters of a memoized function's cache
+        struct memo_stats final
+        {
+            size_t hits = 0;
+            size_t misses = 0;
+
+            /// \brief number of times the cache was cleared because the function was reassigned
+            size_t invalidations = 0;
+        };
+
+        /// \brief returns the counters of the memoized function at aPath, empty if it is not memoized
+        [[nodiscard]] std::optional<memo_stats> memo_statistics(const std::string &aPath) const;
 
         /// \brief registers a closure (c++ lambda with captured data)
         void register_function(const std::string &aName, closure_type a);
 
+        /// \brief starts tracking assignments to the fields of the table at aPath
+        ///
+        /// assigned fields are recorded as dirty and collected with drain_dirty, or reported to
+        /// aCallback instead if one is provided. Tracking is shallow: assignments inside nested
+        /// tables are only seen if those tables are watched too. The table is tracked, not the path;
+        /// replacing the table at aPath from lua ends tracking. Fails if the table has a metatable,
+        /// or is already watched through a different path. An exception thrown by aCallback fails the
+        /// script that made the assignment, or is rethrown as std::runtime_error by the write_value,
+        /// write_values or register_function call that made it; the field is assigned either way.
+        ///
+        /// \warning the fields are moved behind a metatable, so lua's pairs, next and # do not see
+        /// them while the table is watched. read_table and read_values are unaffected
+        [[nodiscard]] error_type watch(const std::string &aPath, watch_callback_type aCallback = {});
+
+        /// \brief stops tracking the table at aPath and moves its fields back into it
+        void unwatch(const std::string &aPath);
+
+        /// \brief returns the paths of fields assigned in watched tables since the last call
+        [[nodiscard]] std::vector<std::string> drain_dirty();
+
         /// \brief registers a instanced closure
         ///void register_function(type, type *instance, name, a);
 
@@ -144,15 +678,155 @@ namespace jfc::lua
         /// \brief run a script, returns an error if something went wrong
         [[nodiscard]] error_type run(const std::string &aLuaScript) const;
         
-        /// \brief construct an interpreter
+        /// \brief creates an environment that shares this interpreter's globals and registered functions
+        [[nodiscard]] environment create_environment();
+
+        /// \brief bytes of memory used by the lua state
+        [[nodiscard]] size_t memory_usage() const;
+
+        /// \brief construct an interpreter with no libraries
         interpreter();
 
+        /// \brief construct an interpreter with the given libraries and preloaded modules
+        explicit interpreter(const options &aOptions);
+
     private:
+        /// \brief writes the value pushed by aPush to the lua context
+        void write_pushed(const std::string &aPath, void (*aPush)(lua_State *, const void *), const void *aValue);
+
+        /// \brief reads the value at aPath with aRead, returns false if it does not exist or aRead fails
+        bool read_with(const std::string &aPath, bool (*aRead)(lua_State *, int, void *), void *aValue) const;
+
         /// \brief state of the internal lua interpreter
         std::unique_ptr<lua_State, std::function<void(lua_State *)>> m_pState;
 
+        /// \brief bookkeeping for a watched table
+        struct watch_type final
+        {
+            /// \brief if set, called instead of recording dirty fields
+            watch_callback_type callback;
+
+            /// \brief paths of fields assigned since the last drain
+            std::unordered_set<std::string> dirty;
+
+            /// \brief false once unwatched; the lua side may still hold a pointer to this
+            bool active = true;
+        };
+
+        /// \brief least recently used cache of a memoized function
+        struct memo_type final
+        {
+            struct entry_type final
+            {
+                size_t hash;
+                params_type params;
+                params_type results;
+            };
+
+            /// \brief most recently used first
+            std::list<entry_type> entries;
+
+            /// \brief entries by hash of their params
+            std::unordered_multimap<size_t, std::list<entry_type>::iterator> index;
+
+            size_t capacity;
+
+            /// \brief registry reference to the function the entries were computed by
+            int reference;
+
+            memo_stats stats;
+
+            /// \brief evicts least recently used entries until at most aSize remain
+            void shrink_to(const size_t aSize);
+        };
+
+        /// \brief memoized functions by path
+        std::unordered_map<std::string, memo_type> m_Memos;
+
         /// \brief closures that have been registered to this interpreter
         std::unordered_map<std::string, closure_type> m_RegisteredClosures;
+
+        /// \brief tables being watched, by path. Entries are never erased so their addresses stay valid
+        std::unordered_map<std::string, watch_type> m_Watches;
+    };
+
+    /// \brief an isolated set of globals within an interpreter
+    ///
+    /// scripts run in an environment read globals missing from the environment from the interpreter's
+    /// globals, but assign globals into the environment only. Many environments can share one interpreter
+    /// and its registered functions; each costs a single table. write_value never writes through to a
+    /// shared table: a path whose first table is not in the environment gets a new table in the environment.
+    ///
+    /// tables reached through the interpreter's globals (string, math, registered function namespaces...)
+    /// are seen by scripts as read-only views, so one environment cannot change what the others see. Views
+    /// behave as tables for type, pairs, ipairs, next, unpack, table.concat and table.maxn. Scripts run with
+    /// the environment as their thread's globals; getfenv, setfenv and getmetatable are replaced so that they
+    /// cannot reach the interpreter's globals, change the environment of shared functions or modify shared
+    /// metatables such as the one of strings, and module is hidden. The c++ read methods see the shared
+    /// tables themselves.
+    ///
+    /// \warning functions defined in the interpreter's globals run with the interpreter's globals, and the
+    /// tables they return are not views
+    /// \warning rawget, rawset, rawequal and the table functions that modify their argument do not accept views
+    /// \warning the debug and jit libraries and collectgarbage reach past environments; do not open them for untrusted scripts
+    /// \warning must not outlive the interpreter that created it
+    class environment final
+    {
+    public:
+        /// \brief methods that can fail return this
+        using error_type = interpreter::error_type;
+
+        /// \brief a value that can be read from or written to a path in the environment
+        using value_type = interpreter::value_type;
+
+        /// \brief writes a [string, boolean] to the environment
+        void write_value(const std::string &aPath, const bool aValue);
+        /// \brief writes a [string, number] to the environment
+        void write_value(const std::string &aPath, const double aValue);
+        /// \brief writes a [string, string] to the environment
+        void write_value(const std::string &aPath, const std::string &aValue);
+        /// \brief writes a [string, string] to the environment
+        void write_value(const std::string &aPath, const std::string::value_type *aValue);
+        /// \brief writes a [string, table] to the environment
+        void write_value(const std::string &aPath, const table &);
+        /// \brief writes a read-only proxy of a shared table to the environment
+        void write_value(const std::string &aPath, const std::shared_ptr<const shared_table> &aValue);
+        /// \brief applies all writes in the batch to the environment
+        void write_values(const interpreter::write_batch &aBatch);
+
+        /// \brief reads a boolean from the environment, falling through to the interpreter's globals
+        [[nodiscard]] std::optional<bool> read_boolean(const std::string &aPath) const;
+        /// \brief reads a number from the environment, falling through to the interpreter's globals
+        [[nodiscard]] std::optional<double> read_number(const std::string &aPath) const;
+        /// \brief reads a string from the environment, falling through to the interpreter's globals
+        [[nodiscard]] std::optional<std::string> read_string(const std::string &aPath) const;
+        /// \brief reads a table from the environment, falling through to the interpreter's globals
+        [[nodiscard]] std::optional<table> read_table(const std::string &aPath) const;
+        /// \brief reads many values in a single traversal of the environment
+        [[nodiscard]] std::vector<std::optional<value_type>> read_values(const std::vector<std::string> &aPaths) const;
+
+        /// \brief run a script in the environment, returns an error if something went wrong
+        [[nodiscard]] error_type run(const std::string &aLuaScript) const;
+
+        environment(environment &&aOther) noexcept;
+        environment &operator=(environment &&aOther) noexcept;
+
+        environment(const environment &) = delete;
+        environment &operator=(const environment &) = delete;
+
+        ~environment();
+
+    private:
+        friend class interpreter;
+
+        /// \brief construct an environment within the given state
+        explicit environment(lua_State *L);
+
+        /// \brief state of the interpreter the environment belongs to
+        lua_State *m_pState;
+
+        /// \brief registry reference to the environment's global table
+        int m_Reference;
     };
 }
 
@@ -4,10 +4,22 @@
 
 #include <lua.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstdlib>
+#include <exception>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <new>
 #include <sstream>
 #include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include <thread>
 #include <tuple>
+#include <utility>
 
 static std::tuple<std::vector<std::string>, std::string> _parse_pathstring(const std::string &aPathString)
 {
@@ -29,63 +41,224 @@ static std::tuple<std::vector<std::string>, std::string> _parse_pathstring(const
     return { path, variableName };
 }
 
-static void _write_value(lua_State *L, const std::string &aPathString, std::function<void()> &&aPushValueFunctor)
+/// \brief restores the height of the lua stack when it goes out of scope
+class _stack_guard final
+{
+public:
+    explicit _stack_guard(lua_State *L) : L(L), m_Top(lua_gettop(L)) {}
+
+    ~_stack_guard() { lua_settop(L, m_Top); }
+
+    _stack_guard(const _stack_guard &) = delete;
+    _stack_guard &operator=(const _stack_guard &) = delete;
+
+private:
+    lua_State *L;
+
+    const int m_Top;
+};
+
+/// \brief metatable field of a watched table that holds the table containing its fields
+static const char *const _watch_backing_field("__jfc_watch");
+
+/// \brief if the table at aIndex is watched, pushes the table holding its fields and returns true
+static bool _push_watch_backing(lua_State *L, const int aIndex)
+{
+    if (!lua_getmetatable(L, aIndex)) return false;
+
+    lua_getfield(L, -1, _watch_backing_field);
+    lua_remove(L, -2);
+
+    if (lua_istable(L, -1)) return true;
+
+    lua_pop(L, 1);
+
+    return false;
+}
+
+/// \brief registry name of the metatable of shared_table proxies
+static constexpr char _shared_table_metatable[] = "jfc::lua::shared_table";
+
+/// \brief true if the value at aIndex has the metatable registered under aName
+static bool _has_metatable(lua_State *L, const int aIndex, const char *const aName)
+{
+    if (!lua_getmetatable(L, aIndex)) return false;
+
+    luaL_getmetatable(L, aName);
+    const bool has(lua_rawequal(L, -1, -2));
+    lua_pop(L, 2);
+
+    return has;
+}
+
+/// \brief true if the value at aIndex is a shared_table proxy, whose fields can be read but not assigned
+static bool _is_shared_table(lua_State *L, const int aIndex)
+{
+    return lua_type(L, aIndex) == LUA_TUSERDATA && _has_metatable(L, aIndex, _shared_table_metatable);
+}
+
+/// \brief throws if the value on top of the stack is a shared_table proxy, rather than replacing it with a table
+static void _check_writable(lua_State *L, const std::string &aSegment)
+{
+    if (_is_shared_table(L, -1)) 
+        throw std::invalid_argument("cannot write into " + aSegment + ": it is a read-only shared_table");
+}
+
+/// \brief pushes the field named by a path segment of the table on top of the stack.
+///
+/// paths have always matched keys by their string form, so if there is no string key the number key
+/// whose string form is the segment is tried, eg "items.1.name" reaches items[1]
+static void _get_segment(lua_State *L, const std::string &aSegment)
+{
+    const int table(lua_gettop(L));
+
+    lua_getfield(L, table, aSegment.c_str());
+
+    if (!lua_isnil(L, -1) || aSegment.empty()) return;
+
+    char *end;
+    const double number(std::strtod(aSegment.c_str(), &end));
+
+    if (*end != '\0') return;
+
+    lua_pop(L, 1);
+
+    lua_pushnumber(L, number);
+    lua_pushvalue(L, -1);
+    const bool canonical(aSegment == lua_tostring(L, -1));
+    lua_pop(L, 1);
+
+    if (canonical) lua_gettable(L, table);
+    else
+    {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+}
+
+/// \brief pushes a field of the root table (the globals, or an environment).
+///
+/// a field missing from an environment is read from the globals directly, so c++ sees the shared
+/// tables themselves rather than the read-only views scripts get. if aRaw, fields of an environment
+/// do not fall through at all, so that writes into an environment never modify shared tables
+static void _get_root_field(lua_State *L, const int aRoot, const std::string &aName, const bool aRaw)
+{
+    if (aRoot == LUA_GLOBALSINDEX)
+    {
+        lua_getfield(L, aRoot, aName.c_str());
+
+        return;
+    }
+
+    lua_pushlstring(L, aName.data(), aName.size());
+    lua_rawget(L, aRoot);
+
+    if (!aRaw && lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_getfield(L, LUA_GLOBALSINDEX, aName.c_str());
+    }
+}
+
+/// \brief the error message on top of the stack, valid while it stays on the stack
+static std::string_view _error_message(lua_State *L)
+{
+    size_t len;
+
+    if (const char *message = lua_tolstring(L, -1, &len)) return {message, len};
+
+    return "error object is not a string";
+}
+
+static int _set_field_unprotected(lua_State *L)
+{
+    lua_settable(L, 1);
+
+    return 0;
+}
+
+/// \brief sets the field aName of the table at aTable to the value on top of the stack, popping the value.
+///
+/// the table's __newindex may call back into c++ (watches do), so a table with a metatable is written
+/// in protected mode, and a lua error is rethrown as a c++ exception instead of reaching the panic handler
+static void _set_field(lua_State *L, int aTable, const char *aName)
+{
+    if (!lua_getmetatable(L, aTable))
+    {
+        lua_setfield(L, aTable, aName);
+
+        return;
+    }
+
+    lua_pop(L, 1);
+
+    if (aTable < 0 && aTable > LUA_REGISTRYINDEX) aTable += lua_gettop(L) + 1;
+
+    lua_pushcfunction(L, _set_field_unprotected);
+    lua_pushvalue(L, aTable);
+    lua_pushstring(L, aName);
+    lua_pushvalue(L, -4);
+
+    if (lua_pcall(L, 3, 0, 0) != LUA_OK)
+    {
+        std::runtime_error failure{std::string(_error_message(L))};
+
+        lua_pop(L, 2);
+
+        throw failure;
+    }
+
+    lua_pop(L, 1);
+}
+
+static void _write_value(lua_State *L, const std::string &aPathString, std::function<void()> &&aPushValueFunctor,
+    const int aRoot = LUA_GLOBALSINDEX)
 {
     auto path_data = _parse_pathstring(aPathString);
 
     std::vector<std::string> &path(std::get<0>(path_data));
     const std::string &variableName(std::get<1>(path_data));
+
+    const _stack_guard guard(L);
    
     if (!path.empty())
     {
-        lua_getglobal(L, path[0].c_str());
+        _get_root_field(L, aRoot, path[0], true);
         if (!lua_istable(L, -1))
         {
+            _check_writable(L, path[0]);
+
             lua_pop(L, 1);
 
             lua_newtable(L);
-            lua_setglobal(L, path[0].c_str());
-            lua_getglobal(L, path[0].c_str());
+            lua_pushvalue(L, -1);
+            _set_field(L, aRoot, path[0].c_str());
         }
 
         for (size_t i(1); i < path.size(); ++i)
         {
-            bool nestedTableExists(false);
+            _get_segment(L, path[i]);
 
-            lua_pushnil(L);
-            while (lua_next(L, -2))
+            if (!lua_istable(L, -1))
             {
-                lua_pushvalue(L, -2);
-
-                if (path[i] == lua_tostring(L, -1) && lua_istable(L, -2))
-                {
-                    nestedTableExists = true;
-
-                    lua_pushvalue(L, -2);
-                    lua_pop(L, 2);
+                _check_writable(L, path[i]);
 
-                    break;
-                }
+                lua_pop(L, 1);
 
-                lua_pop(L, 2);
-            }
-            
-            if (!nestedTableExists)
-            {
                 lua_newtable(L);
-                lua_setfield(L, -2, path[i].c_str());
-                lua_getfield(L, -1, path[i].c_str());
+                lua_pushvalue(L, -1);
+                _set_field(L, -3, path[i].c_str());
             }
         }
     }
     
     aPushValueFunctor();
 
-    if (path.empty()) lua_setglobal(L, variableName.c_str());
-    else lua_setfield(L, -2, variableName.c_str());
+    if (path.empty()) _set_field(L, aRoot, variableName.c_str());
+    else _set_field(L, -2, variableName.c_str());
 }
 
-static bool _read_value(lua_State *L, const std::string &aPath)
+static bool _read_value(lua_State *L, const std::string &aPath, const int aRoot = LUA_GLOBALSINDEX)
 {
     auto path_data = _parse_pathstring(aPath);
 
@@ -94,8 +267,8 @@ static bool _read_value(lua_State *L, const std::string &aPath)
 
     if (!path.empty())
     {
-        lua_getglobal(L, path[0].c_str());
-        if (!lua_istable(L, -1))
+        _get_root_field(L, aRoot, path[0], false);
+        if (!lua_istable(L, -1) && !_is_shared_table(L, -1))
         {
             lua_pop(L, 1);
 
@@ -104,439 +277,2806 @@ static bool _read_value(lua_State *L, const std::string &aPath)
 
         for (size_t i(1); i < path.size(); ++i)
         {
-            bool nestedTableExists(false);
-
-            lua_pushnil(L);
-            while (lua_next(L, -2))
-            {
-                lua_pushvalue(L, -2);
-
-                if (path[i] == lua_tostring(L, -1) && lua_istable(L, -2))
-                {
-                    nestedTableExists = true;
+            _get_segment(L, path[i]);
 
-                    lua_pushvalue(L, -2);
-                    lua_pop(L, 2);
-
-                    break;
-                }
-
-                lua_pop(L, 2);
-            }
-            
-            if (!nestedTableExists) return false;
+            if (!lua_istable(L, -1) && !_is_shared_table(L, -1)) return false;
         }
     
         lua_getfield(L, -1, variableName.c_str());
     }
     else
     {
-        lua_getglobal(L, variableName.c_str());
+        _get_root_field(L, aRoot, variableName, false);
     }
    
     return true;
 }
 
-namespace jfc::lua
+/// \brief keeps the tables along the most recently opened path on the lua stack,
+/// so that a following path sharing a prefix only walks the segments that differ
+class _path_cursor final
 {
-    std::ostream &operator<<(std::ostream &out, const table &a)
+public:
+    explicit _path_cursor(lua_State *L, const int aRoot = LUA_GLOBALSINDEX) : L(L), m_Root(aRoot), m_Base(lua_gettop(L)) {}
+
+    ~_path_cursor() { lua_settop(L, m_Base); }
+
+    _path_cursor(const _path_cursor &) = delete;
+    _path_cursor &operator=(const _path_cursor &) = delete;
+
+    /// \brief leaves the table at aPath on top of the stack, or nothing if aPath is empty.
+    ///
+    /// if aCreate, missing or non-table segments are replaced with new tables and shared_tables throw,
+    /// otherwise shared_tables are read through and returns false when a segment is not a table
+    bool open(const std::vector<std::string> &aPath, const bool aCreate)
     {
-        std::stringstream stream;
+        size_t common(0);
+        while (common < m_Open.size() && common < aPath.size() && m_Open[common] == aPath[common]) ++common;
 
-        stream << "{";
+        lua_settop(L, m_Base + static_cast<int>(common));
+        m_Open.resize(common);
 
-        const size_t size(a.m_NumberFields.size() +
-            + a.m_BooleanFields.size()
-            + a.m_StringFields.size());
-        size_t i(0);
+        if (!lua_checkstack(L, static_cast<int>(aPath.size() - common) + 6))
+            throw std::runtime_error("_path_cursor::open: path is too deep");
 
-        for (const auto &[key, value] : a.m_NumberFields) 
+        for (size_t i(common); i < aPath.size(); ++i)
         {
-            if (key < 1 || std::fmod(key, 1) != 0) stream << "[" << key << "]" << "=";
+            if (i == 0) _get_root_field(L, m_Root, aPath[i], aCreate);
+            else _get_segment(L, aPath[i]);
 
-            std::visit([&stream](auto &&value)
+            if (!lua_istable(L, -1) && (aCreate || !_is_shared_table(L, -1)))
             {
-                using value_type = std::decay_t<decltype(value)>;
-                
-                if constexpr (std::is_same_v<value_type, double>) stream << value;
-                else if constexpr (std::is_same_v<value_type, bool>) stream << (value ? "true" : "false");
-                else if constexpr (std::is_same_v<value_type, std::string>) stream << "\"" << value << "\"";
-                else if constexpr (std::is_same_v<value_type, decltype(nullptr)>) stream << "nil";
-                else if constexpr (std::is_same_v<value_type, std::shared_ptr<table>>) stream << *value;
-                else throw std::runtime_error("table operator<<: unsupported type");
-            }, value);
+                if (aCreate) _check_writable(L, aPath[i]);
+
+                lua_pop(L, 1);
+
+                if (!aCreate) return false;
+
+                lua_newtable(L);
+                lua_pushvalue(L, -1);
+
+                if (i == 0) _set_field(L, m_Root, aPath[i].c_str());
+                else _set_field(L, -3, aPath[i].c_str());
+            }
+
+            m_Open.push_back(aPath[i]);
+        }
+
+        return true;
+    }
+
+private:
+    lua_State *L;
+
+    /// \brief index of the table paths start from
+    const int m_Root;
+
+    /// \brief height of the stack before any tables were opened
+    const int m_Base;
+
+    /// \brief path segments whose tables are currently on the stack
+    std::vector<std::string> m_Open;
+};
+
+static std::optional<jfc::lua::interpreter::value_type> _to_value(lua_State *L, const int aIndex)
+{
+    switch(lua_type(L, aIndex))
+    {
+        case(LUA_TBOOLEAN): return static_cast<bool>(lua_toboolean(L, aIndex));
+        case(LUA_TNUMBER):  return lua_tonumber(L, aIndex);
+        case(LUA_TSTRING):
+        {
+            size_t len;
+            const char *str = lua_tolstring(L, aIndex, &len);
 
-            if (++i != size) stream << ",";
+            return std::string(str, len);
         }
+        case(LUA_TTABLE):   return jfc::lua::table(L, aIndex);
+        default: return {};
+    }
+}
+
+/// \brief writes the key of a field as it appears in a lua table constructor
+static void _write_key(std::ostream &stream, const double aKey)
+{
+    if (aKey < 1 || std::fmod(aKey, 1) != 0) stream << "[" << aKey << "]" << "=";
+}
+
+static void _write_key(std::ostream &stream, const bool aKey)
+{
+    stream << "[" << (aKey ? "true" : "false") << "]" << "=";
+}
+
+static void _write_key(std::ostream &stream, const std::string &aKey)
+{
+    stream << aKey << "=";
+}
+
+/// \brief writes the value of a field as it appears in a lua table constructor
+template<class value_type>
+static void _write_field_value(std::ostream &stream, const value_type &aValue)
+{
+    std::visit([&stream](auto &&value)
+    {
+        using field_type = std::decay_t<decltype(value)>;
         
-        for (const auto &[key, value] : a.m_BooleanFields) 
+        if constexpr (std::is_same_v<field_type, double>) stream << value;
+        else if constexpr (std::is_same_v<field_type, bool>) stream << (value ? "true" : "false");
+        else if constexpr (std::is_same_v<field_type, std::string>) stream << "\"" << value << "\"";
+        else if constexpr (std::is_same_v<field_type, decltype(nullptr)>) stream << "nil";
+        else if constexpr (std::is_same_v<field_type, std::shared_ptr<jfc::lua::table>>) stream << *value;
+        else throw std::runtime_error("table operator<<: unsupported type");
+    }, aValue);
+}
+
+/// \brief calls aFunctor, converting a c++ exception into a lua error.
+///
+/// lua_error is only called once the exception has been caught and destroyed,
+/// so no c++ frame is ever unwound by lua
+template<class functor_type>
+static int _protected_call(lua_State *L, functor_type &&aFunctor)
+{
+    bool failed(false);
+    int results(0);
+
+    try
+    {
+        results = aFunctor();
+    }
+    // only std::exception is caught: luajit raises lua errors as foreign exceptions, which must pass through
+    catch (const std::exception &e)
+    {
+        failed = true;
+
+        luaL_where(L, 1);
+        lua_pushstring(L, e.what());
+    }
+
+    if (!failed) return results;
+
+    lua_concat(L, 2);
+
+    return lua_error(L);
+}
+
+/// \brief calls the function below the aArgumentCount arguments on top of the stack with the error handler,
+/// recording a failure in aError. The handler is left where the function was, below any results
+static bool _protected_run(lua_State *L, jfc::lua::error &aError, const int aArgumentCount = 0, const int aResultCount = 0)
+{
+    const int function(lua_gettop(L) - aArgumentCount);
+
+    lua_pushlightuserdata(L, &aError);
+    lua_pushcclosure(L, jfc::lua::detail::error_handler, 1);
+    lua_insert(L, function);
+
+    const int status(lua_pcall(L, aArgumentCount, aResultCount, function));
+
+    if (status == LUA_OK) return true;
+
+    // memory errors and errors in the handler itself are not recorded by it
+    if (status != LUA_ERRRUN) aError = jfc::lua::error(_error_message(L));
+
+    return false;
+}
+
+/// \brief mixes a value into a hash
+static size_t _hash_combine(const size_t aSeed, const size_t aValue)
+{
+    return aSeed ^ (aValue + 0x9e3779b97f4a7c15ull + (aSeed << 6) + (aSeed >> 2));
+}
+
+/// \brief pushes a parameter of a function call
+static void _push_param(lua_State *L, const jfc::lua::params_type::value_type &aParam)
+{
+    std::visit([L](auto &&param)
+    {
+        using param_type = std::decay_t<decltype(param)>;
+
+        if constexpr (std::is_same_v<param_type, double>) lua_pushnumber(L, param);
+        else if constexpr (std::is_same_v<param_type, bool>) lua_pushboolean(L, param);
+        else if constexpr (std::is_same_v<param_type, std::string>) lua_pushlstring(L, param.data(), param.size());
+        else if constexpr (std::is_same_v<param_type, decltype(nullptr)>) lua_pushnil(L);
+        else if constexpr (std::is_same_v<param_type, jfc::lua::table>) param.push_to_lua_state(L);
+        else throw std::runtime_error("_push_param: unsupported type");
+    }, aParam);
+}
+
+/// \brief converts the value at aIndex to a parameter, returns false if its type is not supported
+static bool _to_param(lua_State *L, const int aIndex, jfc::lua::params_type &aParams)
+{
+    switch(lua_type(L, aIndex))
+    {
+        case(LUA_TNIL):     aParams.push_back(nullptr); return true;
+        case(LUA_TBOOLEAN): aParams.push_back(static_cast<bool>(lua_toboolean(L, aIndex))); return true;
+        case(LUA_TNUMBER):  aParams.push_back(lua_tonumber(L, aIndex)); return true;
+        case(LUA_TSTRING):
+        {
+            size_t len;
+            const char *str = lua_tolstring(L, aIndex, &len);
+
+            aParams.push_back(std::string(str, len));
+        } return true;
+        case(LUA_TTABLE):   aParams.push_back(jfc::lua::table(L, aIndex)); return true;
+        default: return false;
+    }
+}
+
+static size_t _hash_params(const jfc::lua::params_type &aParams)
+{
+    size_t hash(aParams.size());
+
+    for (const auto &param : aParams) hash = _hash_combine(hash, std::visit([](auto &&param) -> size_t
+    {
+        using param_type = std::decay_t<decltype(param)>;
+
+        if constexpr (std::is_same_v<param_type, jfc::lua::table>) return param.hash();
+        else if constexpr (std::is_same_v<param_type, decltype(nullptr)>) return 0;
+        else return std::hash<param_type>()(param);
+    }, param) + param.index());
+
+    return hash;
+}
+
+/// \brief the standard libraries by interpreter::library
+static const struct
+{
+    jfc::lua::interpreter::library library;
+
+    const char *name;
+
+    lua_CFunction open;
+
+    /// \brief other globals created by the library, which also trigger a lazy load
+    const char *aliases[2];
+} _libraries[] =
+{
+    {jfc::lua::interpreter::library::base, "", luaopen_base, {}},
+    {jfc::lua::interpreter::library::package, LUA_LOADLIBNAME, luaopen_package, {"require", "module"}},
+    {jfc::lua::interpreter::library::table, LUA_TABLIBNAME, luaopen_table, {}},
+    {jfc::lua::interpreter::library::string, LUA_STRLIBNAME, luaopen_string, {}},
+    {jfc::lua::interpreter::library::math, LUA_MATHLIBNAME, luaopen_math, {}},
+    {jfc::lua::interpreter::library::io, LUA_IOLIBNAME, luaopen_io, {}},
+    {jfc::lua::interpreter::library::os, LUA_OSLIBNAME, luaopen_os, {}},
+    {jfc::lua::interpreter::library::debug, LUA_DBLIBNAME, luaopen_debug, {}},
+    {jfc::lua::interpreter::library::bit, LUA_BITLIBNAME, luaopen_bit, {}},
+    {jfc::lua::interpreter::library::jit, LUA_JITLIBNAME, luaopen_jit, {}},
+};
+
+static void _open_library(lua_State *L, const jfc::lua::interpreter::library aLibrary)
+{
+    for (const auto &library : _libraries) if (library.library == aLibrary)
+    {
+        lua_pushcfunction(L, library.open);
+        lua_pushstring(L, library.name);
+        lua_call(L, 1, 0);
+
+        return;
+    }
+
+    throw std::invalid_argument("_open_library: unknown library");
+}
+
+static void _update_environment_functions(lua_State *L, const int aGlobals);
+
+/// \brief __index of the globals while libraries are waiting to be loaded.
+///
+/// upvalue 1 maps global names to the opener of their library, upvalue 2 maps openers to library names
+static int _lazy_library_index(lua_State *L)
+{
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+
+    if (lua_isnil(L, -1)) return 1;
+
+    const int open(lua_gettop(L));
+
+    // forget every name of the library before opening it, so that it is only opened once
+    lua_pushnil(L);
+    while (lua_next(L, lua_upvalueindex(1)))
+    {
+        if (lua_rawequal(L, -1, open))
+        {
+            lua_pushvalue(L, -2);
+            lua_pushnil(L);
+            lua_rawset(L, lua_upvalueindex(1));
+        }
+
+        lua_pop(L, 1);
+    }
+
+    // libraries register themselves in the globals of the running thread, which may be an environment's
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+    const int globals(lua_gettop(L));
+    lua_pushvalue(L, 1);
+    lua_replace(L, LUA_GLOBALSINDEX);
+
+    lua_pushvalue(L, open);
+    lua_pushvalue(L, open);
+    lua_rawget(L, lua_upvalueindex(2));
+    const int status(lua_pcall(L, 1, 0, 0));
+
+    lua_pushvalue(L, globals);
+    lua_replace(L, LUA_GLOBALSINDEX);
+
+    if (status != LUA_OK) return lua_error(L);
+
+    _update_environment_functions(L, 1);
+
+    lua_pushvalue(L, 2);
+    lua_rawget(L, 1);
+
+    return 1;
+}
+
+/// \brief __index of strings while the string library is waiting to be loaded.
+///
+/// reading the string global loads the library, which replaces the metatable of strings with its own.
+/// upvalue 1 is the interpreter's globals, as the running thread may be an environment's
+static int _lazy_string_index(lua_State *L)
+{
+    lua_getfield(L, lua_upvalueindex(1), LUA_STRLIBNAME);
+
+    if (!lua_istable(L, -1)) return 0;
+
+    lua_pushvalue(L, 2);
+    lua_gettable(L, -2);
+
+    return 1;
+}
+
+/// \brief registry name of the metatable shared by all environments
+static const char *const _environment_metatable("jfc::lua::environment");
+
+/// \brief registry name of the metatable of read-only views of the interpreter's tables
+static const char *const _readonly_metatable("jfc::lua::readonly");
+
+/// \brief registry name of the weak valued table of read-only views, by the table they view
+static const char *const _readonly_cache("jfc::lua::readonly_cache");
+
+/// \brief registry name of the table mapping functions of the interpreter to what environments get instead.
+///
+/// a replacement is a function, or false for a function hidden from environments
+static const char *const _environment_replacements("jfc::lua::environment_replacements");
+
+/// \brief true if the value at aIndex is a read-only view
+static bool _is_readonly(lua_State *L, const int aIndex)
+{
+    return _has_metatable(L, aIndex, _readonly_metatable);
+}
+
+/// \brief replaces the value on top of the stack with what environments see of it.
+///
+/// tables become read-only views, and functions that could reach past an environment are replaced.
+/// A view is a userdata whose environment is the table it views; views are cached by table, so that
+/// a table always has the same view while it is referenced. Must be called from a c closure whose
+/// upvalue 1 is the cache of views and upvalue 2 the replacements
+static void _to_shared(lua_State *L)
+{
+    switch (lua_type(L, -1))
+    {
+        case LUA_TTABLE: break;
+        case LUA_TFUNCTION:
+        {
+            lua_pushvalue(L, -1);
+            lua_rawget(L, lua_upvalueindex(2));
+
+            if (lua_isnil(L, -1)) lua_pop(L, 1);
+            else
+            {
+                if (!lua_toboolean(L, -1))
+                {
+                    lua_pop(L, 1);
+                    lua_pushnil(L);
+                }
+
+                lua_replace(L, -2);
+            }
+        } return;
+        default: return;
+    }
+
+    lua_pushvalue(L, -1);
+    lua_rawget(L, lua_upvalueindex(1));
+
+    if (!lua_isnil(L, -1))
+    {
+        lua_remove(L, -2);
+
+        return;
+    }
+
+    lua_pop(L, 1);
+
+    lua_newuserdata(L, 0);
+    lua_pushvalue(L, -2);
+    lua_setfenv(L, -2);
+    luaL_getmetatable(L, _readonly_metatable);
+    lua_setmetatable(L, -2);
+
+    lua_pushvalue(L, -2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, lua_upvalueindex(1));
+
+    lua_remove(L, -2);
+}
+
+/// \brief __index of environments: globals missing from the environment, as environments see them.
+///
+/// upvalue 1 is the cache of views, 2 the replacements, 3 the interpreter's globals
+static int _environment_index(lua_State *L)
+{
+    lua_pushvalue(L, 2);
+    lua_gettable(L, lua_upvalueindex(3));
+
+    _to_shared(L);
+
+    return 1;
+}
+
+/// \brief __index of read-only views, upvalue 1 is the cache of views, 2 the replacements
+static int _readonly_index(lua_State *L)
+{
+    lua_getfenv(L, 1);
+    lua_pushvalue(L, 2);
+    lua_gettable(L, -2);
+
+    _to_shared(L);
+
+    return 1;
+}
+
+static int _readonly_newindex(lua_State *L)
+{
+    return luaL_error(L, "attempt to modify a read-only table shared by all environments");
+}
+
+static int _readonly_len(lua_State *L)
+{
+    lua_getfenv(L, 1);
+    lua_pushinteger(L, static_cast<lua_Integer>(lua_objlen(L, -1)));
+
+    return 1;
+}
+
+static int _readonly_tostring(lua_State *L)
+{
+    lua_getfenv(L, 1);
+    lua_pushfstring(L, "table: %p", lua_topointer(L, -1));
+
+    return 1;
+}
+
+/// \brief iterator of pairs over a view, yielding keys and values as environments see them
+static int _readonly_next(lua_State *L)
+{
+    if (!_is_readonly(L, 1)) return luaL_argerror(L, 1, "read-only table expected");
+
+    lua_settop(L, 2);
+    lua_getfenv(L, 1);
+
+    // keys that are tables were handed out as views
+    if (_is_readonly(L, 2))
+    {
+        lua_getfenv(L, 2);
+        lua_replace(L, 2);
+    }
+
+    lua_pushvalue(L, 2);
+
+    if (!lua_next(L, 3))
+    {
+        lua_pushnil(L);
+
+        return 1;
+    }
+
+    _to_shared(L);
+
+    // only tables are wrapped, as next must be given back keys it can find
+    if (lua_istable(L, -2))
+    {
+        lua_pushvalue(L, -2);
+        _to_shared(L);
+        lua_replace(L, -3);
+    }
+
+    return 2;
+}
+
+/// \brief iterator of ipairs over a view
+static int _readonly_inext(lua_State *L)
+{
+    if (!_is_readonly(L, 1)) return luaL_argerror(L, 1, "read-only table expected");
+
+    const int i(luaL_checkint(L, 2) + 1);
+
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, -1, i);
+
+    if (lua_isnil(L, -1)) return 0;
+
+    _to_shared(L);
+    lua_pushinteger(L, i);
+    lua_insert(L, -2);
+
+    return 2;
+}
+
+// replacements of the interpreter's functions are closures whose upvalue 1 is the cache of views,
+// 2 the replacements, 3 the function they replace, 4 the interpreter's globals and 5 their iterator, if any
+
+/// \brief calls the replaced function with the arguments of the replacement, returning all of its results
+static int _call_replaced(lua_State *L)
+{
+    lua_pushvalue(L, lua_upvalueindex(3));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+
+    return lua_gettop(L);
+}
+
+/// \brief pushes the function getfenv or setfenv refer to with the argument at aArgument: a function, or a stack level
+static void _push_fenv_function(lua_State *L, const int aArgument)
+{
+    if (lua_isfunction(L, aArgument))
+    {
+        lua_pushvalue(L, aArgument);
+
+        return;
+    }
+
+    lua_Debug frame;
+
+    if (!lua_getstack(L, luaL_optint(L, aArgument, 1), &frame)) luaL_argerror(L, aArgument, "invalid level");
+
+    lua_getinfo(L, "f", &frame);
+}
+
+/// \brief getfenv, reporting the interpreter's globals as the calling environment and other environments as views
+static int _environment_getfenv(lua_State *L)
+{
+    if (!lua_isfunction(L, 1) && luaL_optint(L, 1, 1) == 0)
+    {
+        lua_pushvalue(L, LUA_GLOBALSINDEX);
+
+        return 1;
+    }
+
+    _push_fenv_function(L, 1);
+
+    if (lua_iscfunction(L, -1)) lua_pushvalue(L, LUA_GLOBALSINDEX);
+    else
+    {
+        lua_getfenv(L, -1);
+
+        if (lua_rawequal(L, -1, lua_upvalueindex(4))) lua_pushvalue(L, LUA_GLOBALSINDEX);
+        else if (!lua_rawequal(L, -1, LUA_GLOBALSINDEX) && _has_metatable(L, -1, _environment_metatable)) _to_shared(L);
+    }
+
+    return 1;
+}
+
+/// \brief setfenv, refusing to change functions that run in the interpreter's globals or another environment
+static int _environment_setfenv(lua_State *L)
+{
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    if (!lua_isfunction(L, 1) && luaL_checkint(L, 1) == 0)
+    {
+        // the thread only runs this environment's script
+        lua_pushvalue(L, 2);
+        lua_replace(L, LUA_GLOBALSINDEX);
+
+        return 0;
+    }
+
+    _push_fenv_function(L, 1);
+    const int function(lua_gettop(L));
+
+    if (lua_iscfunction(L, function)) return luaL_error(L, "'setfenv' cannot change environment of given object");
+
+    lua_getfenv(L, function);
+    const bool shared(lua_rawequal(L, -1, lua_upvalueindex(4)) 
+        || (!lua_rawequal(L, -1, LUA_GLOBALSINDEX) && _has_metatable(L, -1, _environment_metatable)));
+    lua_pop(L, 1);
+
+    if (shared) return luaL_error(L, "'setfenv' cannot change the environment of a function shared with other environments");
+
+    lua_pushvalue(L, 2);
+    lua_setfenv(L, function);
+
+    return 1;
+}
+
+/// \brief getmetatable, giving views of the metatables of values other than tables, as those are shared
+static int _environment_getmetatable(lua_State *L)
+{
+    luaL_checkany(L, 1);
+
+    if (!lua_getmetatable(L, 1)) return 0;
+
+    luaL_getmetafield(L, 1, "__metatable");
+
+    if (lua_type(L, 1) != LUA_TTABLE) _to_shared(L);
+
+    return 1;
+}
+
+static int _environment_type(lua_State *L)
+{
+    luaL_checkany(L, 1);
+
+    lua_pushstring(L, _is_readonly(L, 1) ? "table" : luaL_typename(L, 1));
+
+    return 1;
+}
+
+static int _environment_next(lua_State *L)
+{
+    return _is_readonly(L, 1) ? _readonly_next(L) : _call_replaced(L);
+}
+
+static int _environment_pairs(lua_State *L)
+{
+    if (!_is_readonly(L, 1)) return _call_replaced(L);
+
+    lua_pushvalue(L, lua_upvalueindex(5));
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+
+    return 3;
+}
+
+static int _environment_ipairs(lua_State *L)
+{
+    if (!_is_readonly(L, 1)) return _call_replaced(L);
+
+    lua_pushvalue(L, lua_upvalueindex(5));
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+
+    return 3;
+}
+
+static int _environment_unpack(lua_State *L)
+{
+    const bool readonly(_is_readonly(L, 1));
+
+    if (readonly)
+    {
+        lua_getfenv(L, 1);
+        lua_replace(L, 1);
+    }
+
+    const int results(_call_replaced(L));
+
+    if (readonly) for (int i(1); i <= results; ++i)
+    {
+        lua_pushvalue(L, i);
+        _to_shared(L);
+        lua_replace(L, i);
+    }
+
+    return results;
+}
+
+/// \brief replacement of functions that only read the table passed as their first argument
+static int _environment_read_table(lua_State *L)
+{
+    if (_is_readonly(L, 1))
+    {
+        lua_getfenv(L, 1);
+        lua_replace(L, 1);
+    }
+
+    return _call_replaced(L);
+}
+
+/// \brief require, giving a view of the module, as modules are shared
+static int _environment_require(lua_State *L)
+{
+    lua_settop(L, 1);
+    _call_replaced(L);
+    _to_shared(L);
+
+    return 1;
+}
+
+/// \brief functions of the interpreter that environments get replacements of
+static const struct
+{
+    /// \brief global table holding the function, null for the globals themselves
+    const char *library;
+
+    const char *name;
+
+    /// \brief null hides the function from environments
+    lua_CFunction replacement;
+
+    /// \brief iterator the replacement returns for views
+    lua_CFunction iterator;
+} _environment_functions[] =
+{
+    {nullptr, "getfenv", _environment_getfenv, nullptr},
+    {nullptr, "setfenv", _environment_setfenv, nullptr},
+    {nullptr, "getmetatable", _environment_getmetatable, nullptr},
+    {nullptr, "type", _environment_type, nullptr},
+    {nullptr, "next", _environment_next, nullptr},
+    {nullptr, "pairs", _environment_pairs, _readonly_next},
+    {nullptr, "ipairs", _environment_ipairs, _readonly_inext},
+    {nullptr, "unpack", _environment_unpack, nullptr},
+    {nullptr, "require", _environment_require, nullptr},
+    // registers modules in the shared package.loaded
+    {nullptr, "module", nullptr, nullptr},
+    {LUA_TABLIBNAME, "concat", _environment_read_table, nullptr},
+    {LUA_TABLIBNAME, "maxn", _environment_read_table, nullptr},
+};
+
+/// \brief adds replacements for functions in the globals at aGlobals that do not have one yet.
+///
+/// called when the first environment is created and after a lazy library is loaded. Only raw lookups
+/// are made, so that no library is loaded by it
+static void _update_environment_functions(lua_State *L, const int aGlobals)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, _environment_replacements);
+
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+
+        return;
+    }
+
+    const int replacements(lua_gettop(L));
+
+    lua_getfield(L, LUA_REGISTRYINDEX, _readonly_cache);
+    const int cache(lua_gettop(L));
+
+    for (const auto &function : _environment_functions)
+    {
+        if (function.library)
+        {
+            lua_pushstring(L, function.library);
+            lua_rawget(L, aGlobals);
+
+            if (!lua_istable(L, -1))
+            {
+                lua_pop(L, 1);
+
+                continue;
+            }
+
+            lua_pushstring(L, function.name);
+            lua_rawget(L, -2);
+            lua_remove(L, -2);
+        }
+        else
+        {
+            lua_pushstring(L, function.name);
+            lua_rawget(L, aGlobals);
+        }
+
+        const int original(lua_gettop(L));
+
+        lua_pushvalue(L, original);
+        lua_rawget(L, replacements);
+
+        if (lua_isfunction(L, original) && lua_isnil(L, -1))
+        {
+            lua_pushvalue(L, original);
+
+            if (function.replacement)
+            {
+                lua_pushvalue(L, cache);
+                lua_pushvalue(L, replacements);
+                lua_pushvalue(L, original);
+                lua_pushvalue(L, aGlobals);
+
+                if (function.iterator)
+                {
+                    lua_pushvalue(L, cache);
+                    lua_pushvalue(L, replacements);
+                    lua_pushcclosure(L, function.iterator, 2);
+                }
+                else lua_pushnil(L);
+
+                lua_pushcclosure(L, function.replacement, 5);
+            }
+            else lua_pushboolean(L, false);
+
+            lua_rawset(L, replacements);
+        }
+
+        lua_settop(L, cache);
+    }
+
+    lua_settop(L, replacements - 1);
+}
+
+/// \brief pushes the metatable shared by all environments, creating it and the metatable of views if needed
+static void _push_environment_metatable(lua_State *L)
+{
+    if (!luaL_newmetatable(L, _environment_metatable)) return;
+
+    const int metatable(lua_gettop(L));
+
+    lua_newtable(L);
+    const int cache(lua_gettop(L));
+
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, cache);
+
+    lua_pushvalue(L, cache);
+    lua_setfield(L, LUA_REGISTRYINDEX, _readonly_cache);
+
+    lua_newtable(L);
+    const int replacements(lua_gettop(L));
+
+    lua_pushvalue(L, replacements);
+    lua_setfield(L, LUA_REGISTRYINDEX, _environment_replacements);
+
+    luaL_newmetatable(L, _readonly_metatable);
+    lua_pushvalue(L, cache);
+    lua_pushvalue(L, replacements);
+    lua_pushcclosure(L, _readonly_index, 2);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, _readonly_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, _readonly_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, _readonly_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushboolean(L, false);
+    lua_setfield(L, -2, "__metatable");
+    lua_pop(L, 1);
+
+    lua_pushvalue(L, cache);
+    lua_pushvalue(L, replacements);
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+    lua_pushcclosure(L, _environment_index, 3);
+    lua_setfield(L, metatable, "__index");
+
+    // scripts can neither read nor replace it, so one environment cannot redirect the others' globals
+    lua_pushboolean(L, false);
+    lua_setfield(L, metatable, "__metatable");
+
+    _update_environment_functions(L, LUA_GLOBALSINDEX);
+
+    lua_settop(L, metatable);
+}
+
+/// \brief pushes the table of the environment with the given registry reference, returns its index
+static int _push_environment(lua_State *L, const int aReference)
+{
+    lua_rawgeti(L, LUA_REGISTRYINDEX, aReference);
+
+    return lua_gettop(L);
+}
+
+static std::optional<double> _read_number(lua_State *L, const std::string &aPath, const int aRoot = LUA_GLOBALSINDEX)
+{
+    const _stack_guard guard(L);
+
+    std::optional<double> val;
+
+    if (_read_value(L, aPath, aRoot) && lua_isnumber(L, -1)) 
+        val = lua_tonumber(L, -1);
+
+    return val;
+}
+
+static std::optional<bool> _read_boolean(lua_State *L, const std::string &aPath, const int aRoot = LUA_GLOBALSINDEX)
+{
+    const _stack_guard guard(L);
+
+    std::optional<bool> val;
+
+    if (_read_value(L, aPath, aRoot) && lua_isboolean(L, -1)) 
+        val = lua_toboolean(L, -1);
+
+    return val;
+}
+
+static std::optional<std::string> _read_string(lua_State *L, const std::string &aPath, const int aRoot = LUA_GLOBALSINDEX)
+{
+    const _stack_guard guard(L);
+
+    std::optional<std::string> val;
+
+    if (_read_value(L, aPath, aRoot) && lua_isstring(L, -1))
+    {
+        size_t len;
+        const char *str = lua_tolstring(L, -1, &len);
+
+        std::string msg(str, len);
+        val = msg;
+    }
+
+    return val;
+}
+
+static std::optional<jfc::lua::table> _read_table(lua_State *L, const std::string &aPath, const int aRoot = LUA_GLOBALSINDEX,
+    jfc::lua::table_pool *pPool = nullptr)
+{
+    const _stack_guard guard(L);
+    
+    if (_read_value(L, aPath, aRoot) && lua_istable(L, -1)) 
+        return pPool ? jfc::lua::table(L, -1, *pPool) : jfc::lua::table(L, -1);
+
+    return {};
+}
+
+static std::vector<std::optional<jfc::lua::interpreter::value_type>> _read_values(lua_State *L,
+    const std::vector<std::string> &aPaths, const int aRoot = LUA_GLOBALSINDEX)
+{
+    std::vector<std::tuple<std::vector<std::string>, std::string>> parsed;
+    parsed.reserve(aPaths.size());
+    for (const auto &path : aPaths) parsed.push_back(_parse_pathstring(path));
+
+    // visiting paths in sorted order puts paths with a shared prefix next to each other
+    std::vector<size_t> order(aPaths.size());
+    for (size_t i(0); i < order.size(); ++i) order[i] = i;
+    std::sort(order.begin(), order.end(), [&parsed](const size_t a, const size_t b)
+        { return std::get<0>(parsed[a]) < std::get<0>(parsed[b]); });
+
+    std::vector<std::optional<jfc::lua::interpreter::value_type>> values(aPaths.size());
+
+    _path_cursor cursor(L, aRoot);
+
+    for (const auto i : order)
+    {
+        const auto &[path, variableName] = parsed[i];
+
+        if (!cursor.open(path, false)) continue;
+
+        if (path.empty()) _get_root_field(L, aRoot, variableName, false);
+        else lua_getfield(L, -1, variableName.c_str());
+
+        values[i] = _to_value(L, -1);
+
+        lua_pop(L, 1);
+    }
+
+    return values;
+}
+
+static void _write_values(lua_State *L, const std::vector<std::pair<std::string, jfc::lua::interpreter::value_type>> &aWrites,
+    const int aRoot = LUA_GLOBALSINDEX)
+{
+    // applied in insertion order so that overlapping writes behave as they would with write_value
+    _path_cursor cursor(L, aRoot);
+
+    for (const auto &[pathString, value] : aWrites)
+    {
+        const auto [path, variableName] = _parse_pathstring(pathString);
+
+        cursor.open(path, true);
+
+        std::visit([L](auto &&value)
+        {
+            using value_type = std::decay_t<decltype(value)>;
+
+            if constexpr (std::is_same_v<value_type, bool>) lua_pushboolean(L, value);
+            else if constexpr (std::is_same_v<value_type, double>) lua_pushnumber(L, value);
+            else if constexpr (std::is_same_v<value_type, std::string>) lua_pushlstring(L, value.data(), value.size());
+            else if constexpr (std::is_same_v<value_type, jfc::lua::table>) value.push_to_lua_state(L);
+            else throw std::runtime_error("_write_values: unsupported type");
+        }, value);
+
+        if (path.empty()) _set_field(L, aRoot, variableName.c_str());
+        else _set_field(L, -2, variableName.c_str());
+    }
+}
+
+namespace jfc::lua
+{
+    namespace detail
+    {
+        void create_table(lua_State *L, int aArraySize, int aRecordSize) { lua_createtable(L, aArraySize, aRecordSize); }
+
+        void push_boolean(lua_State *L, bool aValue) { lua_pushboolean(L, aValue); }
+
+        void push_number(lua_State *L, double aValue) { lua_pushnumber(L, aValue); }
+
+        void push_string(lua_State *L, const std::string &aValue) { lua_pushlstring(L, aValue.data(), aValue.size()); }
+
+        void set_field(lua_State *L, const char *aName) { lua_setfield(L, -2, aName); }
+
+        void set_index(lua_State *L, int aIndex) { lua_rawseti(L, -2, aIndex); }
+
+        void get_field(lua_State *L, int aTable, const char *aName) { lua_getfield(L, aTable, aName); }
+
+        void get_index(lua_State *L, int aTable, int aIndex) { lua_rawgeti(L, aTable, aIndex); }
+
+        void pop(lua_State *L, int aCount) { lua_pop(L, aCount); }
+
+        int top(lua_State *L) { return lua_gettop(L); }
+
+        bool is_table(lua_State *L, int aIndex) { return lua_istable(L, aIndex); }
+
+        size_t length(lua_State *L, int aIndex) { return lua_objlen(L, aIndex); }
+
+        bool to_boolean(lua_State *L, int aIndex, bool &aValue)
+        {
+            if (!lua_isboolean(L, aIndex)) return false;
+
+            aValue = lua_toboolean(L, aIndex);
+
+            return true;
+        }
+
+        bool to_number(lua_State *L, int aIndex, double &aValue)
+        {
+            if (lua_type(L, aIndex) != LUA_TNUMBER) return false;
+
+            aValue = lua_tonumber(L, aIndex);
+
+            return true;
+        }
+
+        static_assert(sizeof(lua_Debug::short_src) == sizeof(jfc::lua::error::frame_type::source),
+            "error::frame_type::source must hold lua_Debug::short_src");
+
+        int error_handler(lua_State *L)
+        {
+            auto &error(*static_cast<jfc::lua::error *>(lua_touserdata(L, lua_upvalueindex(1))));
+
+            if (!lua_isstring(L, 1))
+            {
+                lua_pushfstring(L, "(error object is a %s value)", luaL_typename(L, 1));
+                lua_replace(L, 1);
+            }
+
+            size_t len;
+            const char *message = lua_tolstring(L, 1, &len);
+
+            error = jfc::lua::error(std::string_view(message, len));
+
+            lua_Debug frame;
+
+            for (int level(1); error.m_FrameCount < error.m_Frames.size() && lua_getstack(L, level, &frame); ++level)
+            {
+                if (!lua_getinfo(L, "Sl", &frame)) break;
+
+                auto &recorded(error.m_Frames[error.m_FrameCount++]);
+
+                std::copy(std::begin(frame.short_src), std::end(frame.short_src), recorded.source.begin());
+                recorded.source.back() = '\0';
+                recorded.line = frame.currentline;
+            }
+
+            lua_settop(L, 1);
+
+            return 1;
+        }
+
+        bool to_string(lua_State *L, int aIndex, std::string &aValue)
+        {
+            if (lua_type(L, aIndex) != LUA_TSTRING) return false;
+
+            size_t len;
+            const char *str = lua_tolstring(L, aIndex, &len);
+
+            aValue.assign(str, len);
+
+            return true;
+        }
+    }
+
+    std::ostream &operator<<(std::ostream &out, const table &a)
+    {
+        std::stringstream stream;
+
+        stream << "{";
+
+        const size_t size(a.m_NumberFields.size() +
+            + a.m_BooleanFields.size()
+            + a.m_StringFields.size());
+        size_t i(0);
+
+        const auto write_fields = [&stream, &i, size](const auto &fields)
+        {
+            for (const auto &[key, value] : fields) 
+            {
+                _write_key(stream, key);
+                _write_field_value(stream, value);
+
+                if (++i != size) stream << ",";
+            }
+        };
+
+        write_fields(a.m_NumberFields);
+        write_fields(a.m_BooleanFields);
+        write_fields(a.m_StringFields);
+        
+        stream << "}";
+
+        out << stream.str();
+
+        return out;
+    }
+
+    std::string table::to_string(size_t aThreadCount) const
+    {
+        if (!aThreadCount) aThreadCount = std::max(1u, std::thread::hardware_concurrency());
+
+        const auto sequential = [this]()
+        {
+            std::stringstream stream;
+            stream << *this;
+
+            return stream.str();
+        };
+
+        if (aThreadCount == 1) return sequential();
+
+        using key_ref = std::variant<const double *, const bool *, const std::string *>;
+
+        struct field_ref final
+        {
+            key_ref key;
+
+            const value_type *value;
+        };
+
+        /// \brief a piece of the output: fixed text, or a run of fields of one table encoded by a worker
+        struct piece_type final
+        {
+            std::string text;
+
+            std::vector<field_ref> fields;
+
+            /// \brief position of the first field in its table, and the table's field count, for separators
+            size_t first, size;
+        };
+
+        std::unordered_map<const table *, size_t> weights;
+
+        // number of fields in a table and all its subtables, an estimate of the cost of encoding it
+        const std::function<size_t(const table &)> weight = [&weights, &weight](const table &aTable)
+        {
+            if (const auto found = weights.find(&aTable); found != weights.end()) return found->second;
+
+            size_t total(0);
+
+            const auto add = [&total, &weight](const auto &fields)
+            {
+                for (const auto &[key, value] : fields) 
+                {
+                    ++total;
+
+                    if (const auto *pTable = std::get_if<std::shared_ptr<table>>(&value)) total += weight(**pTable);
+                }
+            };
+
+            add(aTable.m_NumberFields);
+            add(aTable.m_BooleanFields);
+            add(aTable.m_StringFields);
+
+            return weights[&aTable] = total;
+        };
+
+        static constexpr size_t minimum_grain(1024);
+
+        const size_t grain(std::max(minimum_grain, weight(*this) / (aThreadCount * 4)));
+
+        // less than one piece of work: starting threads would cost more than encoding
+        if (weight(*this) < grain) return sequential();
+
+        std::vector<piece_type> pieces;
+
+        const auto add_text = [&pieces](const std::string &aText)
+        {
+            if (pieces.empty() || !pieces.back().fields.empty()) pieces.push_back({});
+
+            pieces.back().text += aText;
+        };
+
+        // splits a table into runs of about grain fields, descending into subtables larger than grain
+        const std::function<void(const table &)> plan = [&](const table &aTable)
+        {
+            std::vector<field_ref> fields;
+            fields.reserve(aTable.m_NumberFields.size() + aTable.m_BooleanFields.size() + aTable.m_StringFields.size());
+
+            for (const auto &[key, value] : aTable.m_NumberFields) fields.push_back({&key, &value});
+            for (const auto &[key, value] : aTable.m_BooleanFields) fields.push_back({&key, &value});
+            for (const auto &[key, value] : aTable.m_StringFields) fields.push_back({&key, &value});
+
+            add_text("{");
+
+            piece_type run{{}, {}, 0, fields.size()};
+            size_t runWeight(0);
+
+            const auto flush = [&]()
+            {
+                if (run.fields.empty()) return;
+
+                pieces.push_back(std::move(run));
+
+                run = {{}, {}, 0, fields.size()};
+                runWeight = 0;
+            };
+
+            for (size_t i(0); i < fields.size(); ++i)
+            {
+                const auto *pTable = std::get_if<std::shared_ptr<table>>(fields[i].value);
+                const size_t fieldWeight(1 + (pTable ? weight(**pTable) : 0));
+
+                if (pTable && fieldWeight > grain)
+                {
+                    flush();
+
+                    std::stringstream key;
+                    std::visit([&key](auto *pKey) { _write_key(key, *pKey); }, fields[i].key);
+                    add_text(key.str());
+
+                    plan(**pTable);
+
+                    if (i + 1 != fields.size()) add_text(",");
+                }
+                else
+                {
+                    if (run.fields.empty()) run.first = i;
+
+                    run.fields.push_back(fields[i]);
+                    runWeight += fieldWeight;
+
+                    if (runWeight >= grain) flush();
+                }
+            }
+
+            flush();
+
+            add_text("}");
+        };
+
+        plan(*this);
+
+        std::atomic<size_t> next(0);
+
+        // the first exception thrown by any worker, rethrown on the calling thread once all have joined
+        std::exception_ptr failure;
+        std::mutex failureMutex;
+
+        const auto work = [&pieces, &next, &failure, &failureMutex]()
+        {
+            try
+            {
+                for (size_t i; (i = next++) < pieces.size();)
+                {
+                    auto &piece(pieces[i]);
+
+                    if (piece.fields.empty()) continue;
+
+                    std::stringstream stream;
+
+                    for (size_t j(0); j < piece.fields.size(); ++j)
+                    {
+                        std::visit([&stream](auto *pKey) { _write_key(stream, *pKey); }, piece.fields[j].key);
+                        _write_field_value(stream, *piece.fields[j].value);
+
+                        if (piece.first + j + 1 != piece.size) stream << ",";
+                    }
+
+                    piece.text = stream.str();
+                }
+            }
+            catch (...)
+            {
+                // the output is lost, so the other workers can stop at their next piece
+                next = pieces.size();
+
+                const std::lock_guard<std::mutex> lock(failureMutex);
+
+                if (!failure) failure = std::current_exception();
+            }
+        };
+
+        // no more threads than there are runs of fields to encode
+        const size_t runs(std::count_if(pieces.begin(), pieces.end(), [](const piece_type &aPiece)
+            { return !aPiece.fields.empty(); }));
+        const size_t threadCount(std::min(aThreadCount, runs));
+
+        std::vector<std::thread> workers;
+        if (threadCount > 1) workers.reserve(threadCount - 1);
+
+        // a thread that cannot be started leaves its share to the others
+        try
+        {
+            for (size_t i(1); i < threadCount; ++i) workers.emplace_back(work);
+        }
+        catch (const std::system_error &) {}
+
+        work();
+
+        for (auto &worker : workers) worker.join();
+
+        if (failure) std::rethrow_exception(failure);
+
+        size_t length(0);
+        for (const auto &piece : pieces) length += piece.text.size();
+
+        std::string out;
+        out.reserve(length);
+
+        for (const auto &piece : pieces) out += piece.text;
+
+        return out;
+    }
+
+    void table::push_to_lua_state(lua_State *L) const
+    {
+        lua_newtable(L);
+
+        for (const auto &[key, value] : m_NumberFields) std::visit([L, key](auto &&value)
+        {
+            using value_type = std::decay_t<decltype(value)>;
+            
+            if constexpr (std::is_same_v<value_type, double>)
+            {
+                lua_pushnumber(L, key);
+                lua_pushnumber(L, value);
+                lua_settable(L, -3);
+            }
+            else if constexpr (std::is_same_v<value_type, bool>) 
+            {
+                lua_pushnumber(L, key);
+                lua_pushboolean(L, value);
+                lua_settable(L, -3);
+            }
+            else if constexpr (std::is_same_v<value_type, std::string>) 
+            {
+                lua_pushnumber(L, key);
+                lua_pushstring(L, value.c_str());
+                lua_settable(L, -3);
+            }
+            else if constexpr (std::is_same_v<value_type, std::shared_ptr<table>>)
+            {
+                lua_pushnumber(L, key);
+                value->push_to_lua_state(L);
+                lua_settable(L, -3);
+            }
+            else throw std::runtime_error("table::push_to_lua_state");
+        }, value);
+
+        for (const auto &[key, value] : m_StringFields) std::visit([L, key](auto &&value)
+        {
+            using value_type = std::decay_t<decltype(value)>;
+            
+            if constexpr (std::is_same_v<value_type, double>)
+            {
+                lua_pushnumber(L, value);
+                lua_setfield(L, -2, key.c_str());
+            }
+            else if constexpr (std::is_same_v<value_type, bool>) 
+            {
+                lua_pushboolean(L, value);
+                lua_setfield(L, -2, key.c_str());
+            }
+            else if constexpr (std::is_same_v<value_type, std::string>) 
+            {
+                lua_pushstring(L, value.c_str());
+                lua_setfield(L, -2, key.c_str());
+            }
+            else if constexpr (std::is_same_v<value_type, std::shared_ptr<table>>)
+            {
+                value->push_to_lua_state(L);
+                lua_setfield(L, -2, key.c_str());
+            }
+            else throw std::runtime_error("table::push_to_lua_state");
+
+        }, value);
+        
+        for (const auto &[key, value] : m_BooleanFields) std::visit([L, key](auto &&value)
+        {
+            using value_type = std::decay_t<decltype(value)>;
+            
+            if constexpr (std::is_same_v<value_type, double>)
+            {
+                lua_pushboolean(L, key);
+                lua_pushnumber(L, value);
+                lua_settable(L, -3);
+            }
+            else if constexpr (std::is_same_v<value_type, bool>) 
+            {
+                lua_pushboolean(L, key);
+                lua_pushboolean(L, value);
+                lua_settable(L, -3);
+            }
+            else if constexpr (std::is_same_v<value_type, std::string>) 
+            {
+                lua_pushboolean(L, key);
+                lua_pushstring(L, value.c_str());
+                lua_settable(L, -3);
+            }
+            else if constexpr (std::is_same_v<value_type, std::shared_ptr<table>>)
+            {
+                lua_pushboolean(L, key);
+                value->push_to_lua_state(L);
+                lua_settable(L, -3);
+            }
+            else throw std::runtime_error("table::push_to_lua_state");
+        }, value);
+
+        //for i in maps, push...)
+    }
+
+    table::table(lua_State *L, int aIndex) : table(L, aIndex, nullptr) {}
+
+    table::table(lua_State *L, int aIndex, table_pool &aPool) : table(L, aIndex, &aPool) {}
+
+    table::table(lua_State *L, int aIndex, table_pool *pPool)
+    {
+        if (!lua_istable(L, aIndex)) throw std::runtime_error("index must point to a table");
+
+        if (!_push_watch_backing(L, aIndex)) lua_pushvalue(L, aIndex);
+        
+        lua_pushnil(L);
+        while (lua_next(L, -2))
+        {
+            lua_pushvalue(L, -2);
+
+            std::variant<std::string, double, bool> key;
+
+            switch(lua_type(L, -1))
+            {
+                case(LUA_TSTRING):  key = std::string(lua_tostring(L, -1)); break;
+                case(LUA_TNUMBER):  key = lua_tonumber(L, -1); break;
+                case(LUA_TBOOLEAN): key = static_cast<bool>(lua_toboolean(L, -1)); break;
+                default: throw std::runtime_error("table only supports key types of [bool, number, string]");
+            }
+
+            std::visit([L, pPool, this](auto &&key)
+            {
+                using key_type = std::decay_t<decltype(key)>;
+
+                if constexpr (std::is_same_v<key_type, std::string>)
+                {
+                    std::string &fieldName = key;
+
+                    switch(lua_type(L, -2))
+                    {
+                        case(LUA_TSTRING):  m_StringFields[fieldName] = std::string(lua_tostring(L, -2)); break;
+                        case(LUA_TNUMBER):  m_StringFields[fieldName] = lua_tonumber(L, -2); break;
+                        case(LUA_TBOOLEAN): m_StringFields[fieldName] = static_cast<bool>(lua_toboolean(L, -2)); break;
+                        case(LUA_TTABLE):   m_StringFields[fieldName] = make_subtable(L, -2, pPool); break;
+                        default: throw std::runtime_error("table::table: unsupported value type\n");
+                    }
+                }
+                else if constexpr (std::is_same_v<key_type, double>)
+                {
+                    auto &fieldName = key;
+
+                    switch(lua_type(L, -2))
+                    {
+                        case(LUA_TSTRING):  m_NumberFields[fieldName] = std::string(lua_tostring(L, -2)); break;
+                        case(LUA_TBOOLEAN): m_NumberFields[fieldName] = static_cast<bool>(lua_toboolean(L, -2)); break;
+                        case(LUA_TNUMBER):  m_NumberFields[fieldName] = lua_tonumber(L, -2); break;
+                        case(LUA_TTABLE):   m_NumberFields[fieldName] = make_subtable(L, -2, pPool); break;
+                        default: throw std::runtime_error("table::table: unsupported value type\n");
+                    }
+                }
+                else if constexpr (std::is_same_v<key_type, bool>)
+                {
+                    auto &fieldName = key;
+
+                    switch(lua_type(L, -2))
+                    {
+                        case(LUA_TSTRING):  m_BooleanFields[fieldName] = std::string(lua_tostring(L, -2)); break;
+                        case(LUA_TBOOLEAN): m_BooleanFields[fieldName] = static_cast<bool>(lua_toboolean(L, -2)); break;
+                        case(LUA_TNUMBER):  m_BooleanFields[fieldName] = lua_tonumber(L, -2); break;
+                        case(LUA_TTABLE):   m_BooleanFields[fieldName] = make_subtable(L, -2, pPool); break;
+                        default: throw std::runtime_error("table::table: unsupported value type\n");
+                    }
+                }
+            }, key);
+
+            lua_pop(L, 2);
+        }
+
+        lua_pop(L, 1);
+
+        m_Hash = compute_hash();
+    }
+
+    std::shared_ptr<table> table::make_subtable(lua_State *L, int aIndex, table_pool *pPool)
+    {
+        if (pPool) return pPool->intern(table(L, aIndex, pPool));
+
+        return std::make_shared<table>(table(L, aIndex));
+    }
+
+    size_t table::compute_hash() const
+    {
+        // fields are summed so that the iteration order of the unordered maps does not matter
+        size_t hash(0);
+
+        const auto hash_fields = [&hash](const auto &aFields)
+        {
+            for (const auto &[key, value] : aFields)
+            {
+                const size_t valueHash = std::visit([](auto &&value) -> size_t
+                {
+                    using value_type = std::decay_t<decltype(value)>;
+
+                    if constexpr (std::is_same_v<value_type, std::shared_ptr<table>>) return value->hash();
+                    else return std::hash<value_type>()(value);
+                }, value);
+
+                hash += _hash_combine(_hash_combine(value.index(), std::hash<std::decay_t<decltype(key)>>()(key)), valueHash);
+            }
+        };
+
+        hash_fields(m_NumberFields);
+        hash_fields(m_StringFields);
+        hash_fields(m_BooleanFields);
+
+        return hash;
+    }
+
+    size_t table::hash() const
+    {
+        return m_Hash;
+    }
+
+    bool operator==(const table &a, const table &b)
+    {
+        if (&a == &b) return true;
+
+        if (a.m_Hash != b.m_Hash
+            || a.m_NumberFields.size() != b.m_NumberFields.size()
+            || a.m_StringFields.size() != b.m_StringFields.size()
+            || a.m_BooleanFields.size() != b.m_BooleanFields.size()) return false;
+
+        const auto equal_values = [](const table::value_type &lhs, const table::value_type &rhs)
+        {
+            if (lhs.index() != rhs.index()) return false;
+
+            if (const auto *pLhs = std::get_if<std::shared_ptr<table>>(&lhs))
+            {
+                const auto &pRhs = std::get<std::shared_ptr<table>>(rhs);
+
+                return *pLhs == pRhs || **pLhs == *pRhs;
+            }
+
+            return lhs == rhs;
+        };
+
+        const auto equal_fields = [&equal_values](const auto &lhs, const auto &rhs)
+        {
+            for (const auto &[key, value] : lhs)
+            {
+                const auto found = rhs.find(key);
+
+                if (found == rhs.end() || !equal_values(value, found->second)) return false;
+            }
+
+            return true;
+        };
+
+        return equal_fields(a.m_NumberFields, b.m_NumberFields)
+            && equal_fields(a.m_StringFields, b.m_StringFields)
+            && equal_fields(a.m_BooleanFields, b.m_BooleanFields);
+    }
+
+    bool operator!=(const table &a, const table &b)
+    {
+        return !(a == b);
+    }
+
+    std::shared_ptr<table> table_pool::intern(table &&aTable)
+    {
+        const auto range = m_Tables.equal_range(aTable.hash());
+
+        for (auto it = range.first; it != range.second; ++it) if (*it->second == aTable) return it->second;
+
+        return m_Tables.emplace(aTable.hash(), std::make_shared<table>(std::move(aTable)))->second;
+    }
+
+    size_t table_pool::size() const
+    {
+        return m_Tables.size();
+    }
+
+    void table_pool::clear()
+    {
+        m_Tables.clear();
+    }
+
+    /// \brief the lua side of shared_table: proxy userdata and their metamethods
+    struct shared_table_access final
+    {
+        /// \brief the userdata of a proxy.
+        ///
+        /// the table is kept alive by an owner userdata holding the only shared_ptr of the state, referenced
+        /// from the proxy's environment, so that reading a subtable does not touch the shared reference count
+        struct proxy_type final
+        {
+            const shared_table *table;
+
+            std::uint32_t node;
+        };
+
+        /// \brief a key of a shared_table or of a lookup from lua
+        struct key_type final
+        {
+            shared_table::value_type::kind type;
+
+            bool boolean;
+
+            double number;
+
+            std::string_view string;
+        };
+
+        static constexpr const char *metatable = _shared_table_metatable;
+
+        static constexpr const char *owner_metatable = "jfc::lua::shared_table_owner";
+
+        static key_type to_key(const shared_table &aTable, const shared_table::value_type &aValue)
+        {
+            key_type key{aValue.type, false, 0, {}};
+
+            switch (aValue.type)
+            {
+                case shared_table::value_type::kind::boolean: key.boolean = aValue.boolean; break;
+                case shared_table::value_type::kind::number: key.number = aValue.number; break;
+                case shared_table::value_type::kind::string: 
+                    key.string = std::string_view(aTable.m_Strings).substr(aValue.string.offset, aValue.string.size); break;
+                case shared_table::value_type::kind::table: break;
+            }
+
+            return key;
+        }
+
+        /// \brief strict weak ordering of keys: booleans, then numbers, then strings
+        static bool less(const key_type &a, const key_type &b)
+        {
+            if (a.type != b.type) return a.type < b.type;
+
+            switch (a.type)
+            {
+                case shared_table::value_type::kind::boolean: return a.boolean < b.boolean;
+                case shared_table::value_type::kind::number: return a.number < b.number;
+                case shared_table::value_type::kind::string: return a.string < b.string;
+                default: return false;
+            }
+        }
+
+        /// \brief converts the lua value at aIndex to a key, returns false if it cannot be a key of a shared_table
+        static bool to_key(lua_State *L, const int aIndex, key_type &aKey)
+        {
+            switch (lua_type(L, aIndex))
+            {
+                case LUA_TBOOLEAN:
+                {
+                    aKey.type = shared_table::value_type::kind::boolean;
+                    aKey.boolean = lua_toboolean(L, aIndex);
+                } return true;
+
+                case LUA_TNUMBER:
+                {
+                    aKey.type = shared_table::value_type::kind::number;
+                    aKey.number = lua_tonumber(L, aIndex);
+                } return true;
+
+                case LUA_TSTRING:
+                {
+                    size_t len;
+                    const char *str = lua_tolstring(L, aIndex, &len);
+
+                    aKey.type = shared_table::value_type::kind::string;
+                    aKey.string = std::string_view(str, len);
+                } return true;
+
+                default: return false;
+            }
+        }
+
+        /// \brief position of aKey in the node; sequence first, then entries. Returns false if not present
+        static bool find(const shared_table &aTable, const shared_table::node_type &aNode, const key_type &aKey, 
+            std::uint32_t &aPosition)
+        {
+            if (aKey.type == shared_table::value_type::kind::number && aKey.number >= 1 
+                && aKey.number <= aNode.array_size && std::fmod(aKey.number, 1) == 0)
+            {
+                aPosition = static_cast<std::uint32_t>(aKey.number) - 1;
+
+                return true;
+            }
+
+            const auto begin(aTable.m_Entries.begin() + aNode.entry_offset);
+            const auto end(begin + aNode.entry_size);
+
+            const auto found = std::lower_bound(begin, end, aKey, [&aTable](const auto &aEntry, const key_type &aKey)
+                { return less(to_key(aTable, aEntry.first), aKey); });
+
+            if (found == end || less(aKey, to_key(aTable, found->first))) return false;
+
+            aPosition = aNode.array_size + static_cast<std::uint32_t>(found - begin);
+
+            return true;
+        }
+
+        static proxy_type &to_proxy(lua_State *L, const int aIndex)
+        {
+            return *static_cast<proxy_type *>(luaL_checkudata(L, aIndex, metatable));
+        }
+
+        /// \brief pushes a value of the proxy at aIndex
+        static void push_value(lua_State *L, const int aIndex, const proxy_type &aProxy, const shared_table::value_type &aValue)
+        {
+            switch (aValue.type)
+            {
+                case shared_table::value_type::kind::boolean: lua_pushboolean(L, aValue.boolean); break;
+                case shared_table::value_type::kind::number: lua_pushnumber(L, aValue.number); break;
+                case shared_table::value_type::kind::string: 
+                    lua_pushlstring(L, aProxy.table->m_Strings.data() + aValue.string.offset, aValue.string.size); break;
+                case shared_table::value_type::kind::table: 
+                {
+                    push_proxy(L, *aProxy.table, aValue.table);
+
+                    lua_getfenv(L, aIndex);
+                    lua_setfenv(L, -2);
+                } break;
+            }
+        }
+
+        /// \brief pushes a proxy of the root of aTable, along with the owner of its shared_ptr
+        static void push_root(lua_State *L, const std::shared_ptr<const shared_table> &aTable)
+        {
+            push_proxy(L, *aTable, 0);
+
+            // userdata environments must be tables, so the owner is held by one table shared by all proxies of the root
+            lua_createtable(L, 1, 0);
+            new (lua_newuserdata(L, sizeof(std::shared_ptr<const shared_table>))) std::shared_ptr<const shared_table>(aTable);
+
+            if (luaL_newmetatable(L, owner_metatable))
+            {
+                lua_pushcfunction(L, collect);
+                lua_setfield(L, -2, "__gc");
+            }
+
+            lua_setmetatable(L, -2);
+            lua_rawseti(L, -2, 1);
+            lua_setfenv(L, -2);
+        }
+
+        /// \brief pushes a proxy of a node of aTable; the caller sets its environment to the owner's
+        static void push_proxy(lua_State *L, const shared_table &aTable, const std::uint32_t aNode)
+        {
+            new (lua_newuserdata(L, sizeof(proxy_type))) proxy_type{&aTable, aNode};
+
+            if (luaL_newmetatable(L, metatable))
+            {
+                static const luaL_Reg metamethods[] = 
+                {
+                    {"__index", index},
+                    {"__newindex", newindex},
+                    {"__len", length},
+                    {"__pairs", pairs},
+                    {"__call", pairs},
+                    {"__eq", equal},
+                    {nullptr, nullptr}
+                };
+
+                for (const auto *p(metamethods); p->name; ++p)
+                {
+                    lua_pushcfunction(L, p->func);
+                    lua_setfield(L, -2, p->name);
+                }
+
+                lua_pushboolean(L, false);
+                lua_setfield(L, -2, "__metatable");
+            }
+
+            lua_setmetatable(L, -2);
+        }
+
+        static int index(lua_State *L)
+        {
+            const auto &proxy(to_proxy(L, 1));
+            const auto &table(*proxy.table);
+            const auto &node(table.m_Nodes[proxy.node]);
+
+            key_type key;
+            std::uint32_t position;
+
+            if (!to_key(L, 2, key) || !find(table, node, key, position)) lua_pushnil(L);
+            else if (position < node.array_size) push_value(L, 1, proxy, table.m_Arrays[node.array_offset + position]);
+            else push_value(L, 1, proxy, table.m_Entries[node.entry_offset + position - node.array_size].second);
+
+            return 1;
+        }
+
+        static int newindex(lua_State *L)
+        {
+            return luaL_error(L, "attempt to modify a read-only shared_table");
+        }
+
+        static int length(lua_State *L)
+        {
+            const auto &proxy(to_proxy(L, 1));
+
+            lua_pushnumber(L, proxy.table->m_Nodes[proxy.node].array_size);
+
+            return 1;
+        }
+
+        static int next(lua_State *L)
+        {
+            const auto &proxy(to_proxy(L, 1));
+            const auto &table(*proxy.table);
+            const auto &node(table.m_Nodes[proxy.node]);
+
+            std::uint32_t position(0);
+
+            if (!lua_isnil(L, 2))
+            {
+                key_type key;
+
+                if (!to_key(L, 2, key) || !find(table, node, key, position)) return luaL_error(L, "invalid key to 'next'");
+
+                ++position;
+            }
+
+            if (position < node.array_size)
+            {
+                lua_pushnumber(L, position + 1);
+                push_value(L, 1, proxy, table.m_Arrays[node.array_offset + position]);
+
+                return 2;
+            }
+
+            if (position < node.array_size + node.entry_size)
+            {
+                const auto &entry(table.m_Entries[node.entry_offset + position - node.array_size]);
+
+                push_value(L, 1, proxy, entry.first);
+                push_value(L, 1, proxy, entry.second);
+
+                return 2;
+            }
+
+            lua_pushnil(L);
+
+            return 1;
+        }
+
+        static int pairs(lua_State *L)
+        {
+            to_proxy(L, 1);
+
+            lua_pushcfunction(L, next);
+            lua_pushvalue(L, 1);
+            lua_pushnil(L);
+
+            return 3;
+        }
+
+        static int equal(lua_State *L)
+        {
+            const auto &a(to_proxy(L, 1)), &b(to_proxy(L, 2));
+
+            lua_pushboolean(L, a.table == b.table && a.node == b.node);
+
+            return 1;
+        }
+
+        /// \brief __gc of owners, releasing the state's reference to the table
+        static int collect(lua_State *L)
+        {
+            using owner_type = std::shared_ptr<const shared_table>;
+
+            static_cast<owner_type *>(luaL_checkudata(L, 1, owner_metatable))->~owner_type();
+
+            return 0;
+        }
+    };
+
+    void shared_table::push_to_lua_state(lua_State *L, const std::shared_ptr<const shared_table> &aTable)
+    {
+        if (!aTable) throw std::invalid_argument("shared_table::push_to_lua_state: table is null");
+
+        shared_table_access::push_root(L, aTable);
+    }
+
+    shared_table::shared_table(const table &aTable)
+    {
+        add_node(aTable);
+    }
+
+    std::uint32_t shared_table::add_node(const table &aTable)
+    {
+        if (m_Nodes.size() >= std::numeric_limits<std::uint32_t>::max())
+            throw std::length_error("shared_table: too many tables");
+
+        const auto index(static_cast<std::uint32_t>(m_Nodes.size()));
+        m_Nodes.emplace_back();
+
+        std::vector<value_type> array;
+        std::vector<std::pair<value_type, value_type>> entries;
+
+        for (const auto &[key, value] : aTable.m_NumberFields)
+        {
+            // number fields are ordered, so the sequence [1..n] is found in one pass
+            if (key == array.size() + 1) array.push_back(add_value(value));
+            else
+            {
+                value_type k;
+                k.type = value_type::kind::number;
+                k.number = key;
+
+                entries.emplace_back(k, add_value(value));
+            }
+        }
+
+        for (const auto &[key, value] : aTable.m_BooleanFields)
+        {
+            value_type k;
+            k.type = value_type::kind::boolean;
+            k.boolean = key;
+
+            entries.emplace_back(k, add_value(value));
+        }
+
+        for (const auto &[key, value] : aTable.m_StringFields) entries.emplace_back(add_string(key), add_value(value));
+
+        std::sort(entries.begin(), entries.end(), [this](const auto &a, const auto &b)
+        {
+            return shared_table_access::less(shared_table_access::to_key(*this, a.first), 
+                shared_table_access::to_key(*this, b.first));
+        });
+
+        if (m_Arrays.size() + array.size() > std::numeric_limits<std::uint32_t>::max())
+            throw std::length_error("shared_table: too many sequence values");
+
+        if (m_Entries.size() + entries.size() > std::numeric_limits<std::uint32_t>::max())
+            throw std::length_error("shared_table: too many fields");
+
+        m_Nodes[index] = node_type{
+            static_cast<std::uint32_t>(m_Arrays.size()), static_cast<std::uint32_t>(array.size()),
+            static_cast<std::uint32_t>(m_Entries.size()), static_cast<std::uint32_t>(entries.size())};
+
+        m_Arrays.insert(m_Arrays.end(), array.begin(), array.end());
+        m_Entries.insert(m_Entries.end(), entries.begin(), entries.end());
+
+        return index;
+    }
+
+    shared_table::value_type shared_table::add_value(const table::value_type &aValue)
+    {
+        return std::visit([this](auto &&value)
+        {
+            using field_type = std::decay_t<decltype(value)>;
+
+            value_type v;
+            
+            if constexpr (std::is_same_v<field_type, double>)
+            {
+                v.type = value_type::kind::number;
+                v.number = value;
+            }
+            else if constexpr (std::is_same_v<field_type, bool>)
+            {
+                v.type = value_type::kind::boolean;
+                v.boolean = value;
+            }
+            else if constexpr (std::is_same_v<field_type, std::string>) v = add_string(value);
+            else if constexpr (std::is_same_v<field_type, std::shared_ptr<table>>)
+            {
+                const auto node(add_node(*value));
+
+                v.type = value_type::kind::table;
+                v.table = node;
+            }
+            else throw std::runtime_error("shared_table::add_value: unsupported type");
+
+            return v;
+        }, aValue);
+    }
+
+    shared_table::value_type shared_table::add_string(const std::string &aValue)
+    {
+        if (m_Strings.size() + aValue.size() > std::numeric_limits<std::uint32_t>::max())
+            throw std::length_error("shared_table: too much string data");
+
+        value_type v;
+        v.type = value_type::kind::string;
+        v.string = {static_cast<std::uint32_t>(m_Strings.size()), static_cast<std::uint32_t>(aValue.size())};
+
+        m_Strings += aValue;
+
+        return v;
+    }
+
+    std::optional<double> interpreter::read_number(const std::string &aPath) const
+    {
+        return _read_number(m_pState.get(), aPath);
+    }
+
+    std::optional<bool> interpreter::read_boolean(const std::string &aPath) const
+    {
+        return _read_boolean(m_pState.get(), aPath);
+    }
+
+    std::optional<std::string> interpreter::read_string(const std::string &aPath) const
+    {
+        return _read_string(m_pState.get(), aPath);
+    }
+
+    std::optional<table> interpreter::read_table(const std::string &aPath) const
+    {
+        return _read_table(m_pState.get(), aPath);
+    }
+
+    std::optional<table> interpreter::read_table(const std::string &aPath, table_pool &aPool) const
+    {
+        return _read_table(m_pState.get(), aPath, LUA_GLOBALSINDEX, &aPool);
+    }
+
+    void interpreter::write_value(const std::string &aPath, const bool aValue)
+    {
+        _write_value(m_pState.get(), aPath, [L = m_pState.get(), aValue]()
+            { lua_pushboolean(L, aValue); });
+    }
+
+    void interpreter::write_value(const std::string &aPath, const double aValue)
+    {
+        _write_value(m_pState.get(), aPath, [L = m_pState.get(), aValue]()
+            { lua_pushnumber(L, aValue); });
+    }
+
+    void interpreter::write_value(const std::string &aPath, const std::string &aValue)
+    {
+        _write_value(m_pState.get(), aPath, [L = m_pState.get(), &aValue]()
+            { lua_pushstring(L, aValue.c_str()); });
+    }
+
+    void interpreter::write_value(const std::string &aPath, const std::string::value_type *aValue)
+    {
+        _write_value(m_pState.get(), aPath, [L = m_pState.get(), &aValue]()
+            { lua_pushstring(L, aValue); });
+    }
+
+    void interpreter::write_value(const std::string &aPath, const table &aValue)
+    {
+        _write_value(m_pState.get(), aPath, [L = m_pState.get(), &aValue]()
+            { aValue.push_to_lua_state(L); });
+    }
+
+    void interpreter::write_value(const std::string &aPath, const std::shared_ptr<const shared_table> &aValue)
+    {
+        _write_value(m_pState.get(), aPath, [L = m_pState.get(), &aValue]()
+            { shared_table::push_to_lua_state(L, aValue); });
+    }
+
+    std::vector<std::optional<interpreter::value_type>> interpreter::read_values(const std::vector<std::string> &aPaths) const
+    {
+        return _read_values(m_pState.get(), aPaths);
+    }
+
+    void interpreter::write_values(const write_batch &aBatch)
+    {
+        _write_values(m_pState.get(), aBatch.m_Writes);
+    }
+
+    interpreter::write_batch &interpreter::write_batch::write_value(const std::string &aPath, const bool aValue)
+    {
+        m_Writes.emplace_back(aPath, aValue);
+
+        return *this;
+    }
+
+    interpreter::write_batch &interpreter::write_batch::write_value(const std::string &aPath, const double aValue)
+    {
+        m_Writes.emplace_back(aPath, aValue);
+
+        return *this;
+    }
+
+    interpreter::write_batch &interpreter::write_batch::write_value(const std::string &aPath, const std::string &aValue)
+    {
+        m_Writes.emplace_back(aPath, aValue);
+
+        return *this;
+    }
+
+    interpreter::write_batch &interpreter::write_batch::write_value(const std::string &aPath, const std::string::value_type *aValue)
+    {
+        m_Writes.emplace_back(aPath, std::string(aValue));
+
+        return *this;
+    }
+
+    interpreter::write_batch &interpreter::write_batch::write_value(const std::string &aPath, const table &aValue)
+    {
+        m_Writes.emplace_back(aPath, aValue);
+
+        return *this;
+    }
+
+    size_t interpreter::write_batch::size() const
+    {
+        return m_Writes.size();
+    }
+
+    void interpreter::write_pushed(const std::string &aPath, void (*aPush)(lua_State *, const void *), const void *aValue)
+    {
+        _write_value(m_pState.get(), aPath, [L = m_pState.get(), aPush, aValue]()
+            { aPush(L, aValue); });
+    }
+
+    bool interpreter::read_with(const std::string &aPath, bool (*aRead)(lua_State *, int, void *), void *aValue) const
+    {
+        auto *L(m_pState.get());
+        const _stack_guard guard(L);
+
+        return _read_value(L, aPath) && aRead(L, lua_gettop(L), aValue);
+    }
+
+    void interpreter::register_function(const std::string &aName, closure_type aClosure)
+    {
+        m_RegisteredClosures[aName] = aClosure;
+
+        auto wrapper = [](lua_State *p)
+        {
+            return _protected_call(p, [p]()
+            {
+                auto *pImpl = static_cast<decltype(m_RegisteredClosures)::mapped_type *>(
+                    lua_touserdata(p, lua_upvalueindex(1)));
+
+                params_type args;
+
+                for (size_t i(1); i < 1 + lua_gettop(p); ++i)
+                {
+                    if (lua_isnumber(p, i)) args.push_back(lua_tonumber(p, i));
+                    else if (lua_isboolean(p, i)) args.push_back(static_cast<bool>(lua_toboolean(p, i)));
+                    else if (lua_isstring(p, i))
+                    {
+                        size_t len;
+                        const char *str = lua_tolstring(p, i, &len);
+
+                        args.push_back(std::string(str, len));
+                    }
+                    else if (lua_istable(p, i)) args.push_back(table(p, i));
+                    else throw std::runtime_error("unsupported parameter type");
+                }
+
+                auto return_values = (*pImpl)(args);
+
+                for (const auto &val : return_values) std::visit([&p](auto &&val)
+                {
+                    using return_type = std::decay_t<decltype(val)>;
+                
+                    if constexpr (std::is_same_v<return_type, double>) lua_pushnumber(p, val);        
+                    else if constexpr (std::is_same_v<return_type, bool>) lua_pushboolean(p, val);        
+                    else if constexpr (std::is_same_v<return_type, std::string>) lua_pushstring(p, val.c_str());        
+                    else if constexpr (std::is_same_v<return_type, table>) val.push_to_lua_state(p);
+                    else throw std::runtime_error("unsupported return type");
+                }, val);
+
+                return static_cast<int>(return_values.size());
+            });
+        };
+
+        _write_value(m_pState.get(), aName, [L = m_pState.get(), &aName, wrapper, this]()
+        { 
+            lua_pushlightuserdata(L, &(this->m_RegisteredClosures[aName]));
+            lua_pushcclosure(L, wrapper, 1); 
+        });
+    }
+
+    std::optional<params_type> interpreter::call_function(const std::string &aPath, const params_type &aParams,
+        error_type *pError)
+    {
+        auto *L(m_pState.get());
+        const _stack_guard guard(L);
+
+        if (!_read_value(L, aPath) || !lua_isfunction(L, -1)) return {};
+
+        const int function(lua_gettop(L));
+
+        memo_type *pMemo(nullptr);
+        size_t hash(0);
+
+        if (const auto found = m_Memos.find(aPath); found != m_Memos.end())
+        {
+            pMemo = &found->second;
+
+            lua_rawgeti(L, LUA_REGISTRYINDEX, pMemo->reference);
+            const bool reassigned(!lua_rawequal(L, -1, function));
+            lua_pop(L, 1);
+
+            if (reassigned)
+            {
+                if (pMemo->reference != LUA_NOREF)
+                {
+                    pMemo->shrink_to(0);
+                    ++pMemo->stats.invalidations;
+
+                    luaL_unref(L, LUA_REGISTRYINDEX, pMemo->reference);
+                }
+
+                lua_pushvalue(L, function);
+                pMemo->reference = luaL_ref(L, LUA_REGISTRYINDEX);
+            }
+
+            hash = _hash_params(aParams);
+
+            const auto range = pMemo->index.equal_range(hash);
+
+            for (auto it = range.first; it != range.second; ++it) if (it->second->params == aParams)
+            {
+                ++pMemo->stats.hits;
+
+                pMemo->entries.splice(pMemo->entries.begin(), pMemo->entries, it->second);
+
+                return pMemo->entries.front().results;
+            }
+
+            ++pMemo->stats.misses;
+        }
+
+        if (!lua_checkstack(L, static_cast<int>(aParams.size()) + 2))
+        {
+            if (pError) *pError = error("call_function: too many parameters");
+
+            return {};
+        }
+
+        lua_pushvalue(L, function);
+        for (const auto &param : aParams) _push_param(L, param);
+
+        error failure{std::string_view()};
+
+        if (!_protected_run(L, failure, static_cast<int>(aParams.size()), LUA_MULTRET))
+        {
+            if (pError) *pError = std::move(failure);
+
+            return {};
+        }
+
+        params_type results;
+
+        // the error handler is left at function + 1
+        for (int i(function + 2); i <= lua_gettop(L); ++i)
+        {
+            try
+            {
+                if (_to_param(L, i, results)) continue;
+            }
+            catch (const std::runtime_error &e)
+            {
+                // a returned table holding a function, userdata or table key
+                if (pError) *pError = error(std::string("call_function: unsupported return value: ") + e.what());
+
+                return {};
+            }
+
+            if (pError) *pError = error(std::string("call_function: unsupported return type ") + luaL_typename(L, i));
+
+            return {};
+        }
+
+        if (pMemo && pMemo->capacity)
+        {
+            pMemo->shrink_to(pMemo->capacity - 1);
+
+            pMemo->entries.push_front({hash, aParams, results});
+            pMemo->index.emplace(hash, pMemo->entries.begin());
+        }
+
+        return results;
+    }
+
+    void interpreter::memoize(const std::string &aPath, const size_t aCapacity)
+    {
+        auto [found, inserted] = m_Memos.try_emplace(aPath);
+        auto &memo(found->second);
+
+        // the function is referenced by the first call, which is where reassignment is checked
+        if (inserted) memo.reference = LUA_NOREF;
+
+        memo.capacity = aCapacity;
+        memo.shrink_to(aCapacity);
+    }
+
+    void interpreter::memo_type::shrink_to(const size_t aSize)
+    {
+        while (entries.size() > aSize)
+        {
+            const auto last = std::prev(entries.end());
+            const auto range = index.equal_range(last->hash);
+
+            for (auto it = range.first; it != range.second; ++it) if (it->second == last)
+            {
+                index.erase(it);
+
+                break;
+            }
+
+            entries.erase(last);
+        }
+    }
+
+    void interpreter::unmemoize(const std::string &aPath)
+    {
+        if (const auto found = m_Memos.find(aPath); found != m_Memos.end())
+        {
+            luaL_unref(m_pState.get(), LUA_REGISTRYINDEX, found->second.reference);
+
+            m_Memos.erase(found);
+        }
+    }
+
+    std::optional<interpreter::memo_stats> interpreter::memo_statistics(const std::string &aPath) const
+    {
+        if (const auto found = m_Memos.find(aPath); found != m_Memos.end()) return found->second.stats;
+
+        return {};
+    }
+
+    interpreter::error_type interpreter::watch(const std::string &aPath, watch_callback_type aCallback)
+    {
+        auto *L(m_pState.get());
+        const _stack_guard guard(L);
+
+        if (!_read_value(L, aPath) || !lua_istable(L, -1)) return error("watch: " + aPath + " is not a table");
+
+        const int watched(lua_gettop(L));
+
+        if (_push_watch_backing(L, watched))
+        {
+            // upvalue 1 of __newindex is the entry the table reports to
+            lua_getmetatable(L, watched);
+            lua_getfield(L, -1, "__newindex");
+            lua_getupvalue(L, -1, 1);
+
+            const auto found = m_Watches.find(aPath);
+
+            if (found == m_Watches.end() || lua_touserdata(L, -1) != &found->second)
+                return error("watch: " + aPath + " is already watched through another path");
+
+            found->second.callback = std::move(aCallback);
+            found->second.active = true;
+
+            return {};
+        }
+
+        if (lua_getmetatable(L, watched)) return error("watch: " + aPath + " already has a metatable");
+
+        auto &watch = m_Watches[aPath];
+        watch.callback = std::move(aCallback);
+        watch.active = true;
+
+        // move the fields into a backing table so every assignment to the watched table hits __newindex
+        lua_newtable(L);
+        const int backing(lua_gettop(L));
+
+        lua_pushnil(L);
+        while (lua_next(L, watched))
+        {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, backing);
+
+            lua_pushvalue(L, -1);
+            lua_pushnil(L);
+            lua_rawset(L, watched);
+        }
+
+        auto newindex = [](lua_State *p)
+        {
+            return _protected_call(p, [p]()
+            {
+                auto *pWatch = static_cast<decltype(m_Watches)::mapped_type *>(
+                    lua_touserdata(p, lua_upvalueindex(1)));
+
+                lua_pushvalue(p, 2);
+                lua_pushvalue(p, 3);
+                lua_rawset(p, lua_upvalueindex(2));
+
+                if (!pWatch->active) return 0;
+
+                std::string field(lua_tostring(p, lua_upvalueindex(3)));
+                field += ".";
+
+                switch(lua_type(p, 2))
+                {
+                    case(LUA_TBOOLEAN): field += lua_toboolean(p, 2) ? "true" : "false"; break;
+                    case(LUA_TNUMBER):
+                    case(LUA_TSTRING):
+                    {
+                        lua_pushvalue(p, 2);
+                        field += lua_tostring(p, -1);
+                        lua_pop(p, 1);
+                    } break;
+                    default: field += lua_typename(p, lua_type(p, 2)); break;
+                }
+
+                if (pWatch->callback) pWatch->callback(field);
+                else pWatch->dirty.insert(std::move(field));
+
+                return 0;
+            });
+        };
+
+        lua_createtable(L, 0, 3);
+
+        lua_pushvalue(L, backing);
+        lua_setfield(L, -2, "__index");
+
+        lua_pushlightuserdata(L, &watch);
+        lua_pushvalue(L, backing);
+        lua_pushlstring(L, aPath.data(), aPath.size());
+        lua_pushcclosure(L, newindex, 3);
+        lua_setfield(L, -2, "__newindex");
+
+        lua_pushvalue(L, backing);
+        lua_setfield(L, -2, _watch_backing_field);
+
+        lua_setmetatable(L, watched);
+
+        return {};
+    }
+
+    void interpreter::unwatch(const std::string &aPath)
+    {
+        auto *L(m_pState.get());
+        const _stack_guard guard(L);
+
+        if (const auto found = m_Watches.find(aPath); found != m_Watches.end()) found->second.active = false;
+
+        if (!_read_value(L, aPath) || !lua_istable(L, -1)) return;
+
+        const int watched(lua_gettop(L));
+
+        if (!_push_watch_backing(L, watched)) return;
+
+        lua_pushnil(L);
+        lua_setmetatable(L, watched);
+
+        lua_pushnil(L);
+        while (lua_next(L, -2))
+        {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, watched);
+        }
+    }
+
+    std::vector<std::string> interpreter::drain_dirty()
+    {
+        std::vector<std::string> dirty;
+
+        for (auto &[path, watch] : m_Watches)
+        {
+            dirty.insert(dirty.end(), watch.dirty.begin(), watch.dirty.end());
+            watch.dirty.clear();
+        }
+
+        return dirty;
+    }
+
+    environment interpreter::create_environment()
+    {
+        return environment(m_pState.get());
+    }
+
+    interpreter::interpreter() : m_pState(luaL_newstate(), [](lua_State *p){lua_close(p);}) {}
+
+    interpreter::interpreter(const options &aOptions) : interpreter()
+    {
+        auto *L(m_pState.get());
+        const _stack_guard guard(L);
+
+        for (const auto library : aOptions.libraries) _open_library(L, library);
+
+        bool packageOpened(std::find(aOptions.libraries.begin(), aOptions.libraries.end(), library::package) 
+            != aOptions.libraries.end());
+
+        if (!aOptions.preload.empty() && !packageOpened)
+        {
+            _open_library(L, library::package);
+            packageOpened = true;
+        }
+
+        lua_createtable(L, 0, static_cast<int>(aOptions.lazy_libraries.size()));
+        const int openers(lua_gettop(L));
+        lua_createtable(L, 0, static_cast<int>(aOptions.lazy_libraries.size()));
+        const int names(lua_gettop(L));
+        bool anyLazy(false);
+
+        for (const auto lazy : aOptions.lazy_libraries)
+        {
+            if (lazy == library::base) _open_library(L, lazy);
+            else if (lazy == library::package && packageOpened) continue;
+            else for (const auto &library : _libraries) if (library.library == lazy)
+            {
+                lua_pushcfunction(L, library.open);
+                const int open(lua_gettop(L));
+
+                lua_pushvalue(L, open);
+                lua_pushstring(L, library.name);
+                lua_rawset(L, names);
+
+                lua_pushvalue(L, open);
+                lua_setfield(L, openers, library.name);
+
+                for (const auto *alias : library.aliases) if (alias)
+                {
+                    lua_pushvalue(L, open);
+                    lua_setfield(L, openers, alias);
+                }
+
+                lua_pop(L, 1);
+
+                anyLazy = true;
+            }
+        }
+
+        if (anyLazy)
         {
-            stream << "[" << (key ? "true" : "false") << "]" << "=";
+            lua_createtable(L, 0, 1);
+            lua_pushvalue(L, openers);
+            lua_pushvalue(L, names);
+            lua_pushcclosure(L, _lazy_library_index, 2);
+            lua_setfield(L, -2, "__index");
+            lua_setmetatable(L, LUA_GLOBALSINDEX);
+
+            // string methods are looked up through the metatable of strings, not the globals,
+            // so a lazy string library also needs a metatable that loads it
+            lua_getfield(L, openers, LUA_STRLIBNAME);
+            const bool lazyString(!lua_isnil(L, -1));
+            lua_pop(L, 1);
 
-            std::visit([&stream](auto &&value)
+            lua_pushliteral(L, "");
+
+            if (lazyString && !lua_getmetatable(L, -1))
             {
-                using value_type = std::decay_t<decltype(value)>;
-                
-                if constexpr (std::is_same_v<value_type, double>) stream << value;
-                else if constexpr (std::is_same_v<value_type, bool>) stream << (value ? "true" : "false");
-                else if constexpr (std::is_same_v<value_type, std::string>) stream << "\"" << value << "\"";
-                else if constexpr (std::is_same_v<value_type, decltype(nullptr)>) stream << "nil";
-                else if constexpr (std::is_same_v<value_type, std::shared_ptr<table>>) stream << *value;
-                else throw std::runtime_error("table operator<<: unsupported type");
-            }, value);
+                lua_createtable(L, 0, 1);
+                lua_pushvalue(L, LUA_GLOBALSINDEX);
+                lua_pushcclosure(L, _lazy_string_index, 1);
+                lua_setfield(L, -2, "__index");
+                lua_setmetatable(L, -2);
+            }
 
-            if (++i != size) stream << ",";
+            lua_pop(L, 1);
         }
 
-        for (const auto &[key, value] : a.m_StringFields) 
+        if (!aOptions.preload.empty())
         {
-            stream << key << "=";
+            lua_getglobal(L, LUA_LOADLIBNAME);
+            lua_getfield(L, -1, "preload");
 
-            std::visit([&stream](auto &&value)
+            for (const auto &[name, source] : aOptions.preload)
             {
-                using value_type = std::decay_t<decltype(value)>;
-                
-                if constexpr (std::is_same_v<value_type, double>) stream << value;
-                else if constexpr (std::is_same_v<value_type, bool>) stream << (value ? "true" : "false");
-                else if constexpr (std::is_same_v<value_type, std::string>) stream << "\"" << value << "\"";
-                else if constexpr (std::is_same_v<value_type, decltype(nullptr)>) stream << "nil";
-                else if constexpr (std::is_same_v<value_type, std::shared_ptr<table>>) stream << *value;
-                else throw std::runtime_error("table operator<<: unsupported type");
-            }, value);
+                if (luaL_loadbuffer(L, source.data(), source.size(), name.c_str()) != LUA_OK)
+                    throw std::runtime_error("interpreter: could not load preloaded module " + name + ": " 
+                        + lua_tostring(L, -1));
 
-            if (++i != size) stream << ",";
+                lua_setfield(L, -2, name.c_str());
+            }
         }
-        
-        stream << "}";
-
-        out << stream.str();
+    }
 
-        return out;
+    size_t interpreter::memory_usage() const
+    {
+        return static_cast<size_t>(lua_gc(m_pState.get(), LUA_GCCOUNT, 0)) * 1024 
+            + static_cast<size_t>(lua_gc(m_pState.get(), LUA_GCCOUNTB, 0));
     }
 
-    void table::push_to_lua_state(lua_State *L) const
+    interpreter::error_type interpreter::run(const std::string &aLuaScript) const
     {
-        lua_newtable(L);
+        auto *L(m_pState.get());
+        const _stack_guard guard(L);
 
-        for (const auto &[key, value] : m_NumberFields) std::visit([L, key](auto &&value)
-        {
-            using value_type = std::decay_t<decltype(value)>;
-            
-            if constexpr (std::is_same_v<value_type, double>)
-            {
-                lua_pushnumber(L, key);
-                lua_pushnumber(L, value);
-                lua_settable(L, -3);
-            }
-            else if constexpr (std::is_same_v<value_type, bool>) 
-            {
-                lua_pushnumber(L, key);
-                lua_pushboolean(L, value);
-                lua_settable(L, -3);
-            }
-            else if constexpr (std::is_same_v<value_type, std::string>) 
-            {
-                lua_pushnumber(L, key);
-                lua_pushstring(L, value.c_str());
-                lua_settable(L, -3);
-            }
-            else if constexpr (std::is_same_v<value_type, std::shared_ptr<table>>)
-            {
-                lua_pushnumber(L, key);
-                value->push_to_lua_state(L);
-                lua_settable(L, -3);
-            }
-            else throw std::runtime_error("table::push_to_lua_state");
-        }, value);
+        error failure{std::string_view()};
 
-        for (const auto &[key, value] : m_StringFields) std::visit([L, key](auto &&value)
-        {
-            using value_type = std::decay_t<decltype(value)>;
-            
-            if constexpr (std::is_same_v<value_type, double>)
-            {
-                lua_pushnumber(L, value);
-                lua_setfield(L, -2, key.c_str());
-            }
-            else if constexpr (std::is_same_v<value_type, bool>) 
-            {
-                lua_pushboolean(L, value);
-                lua_setfield(L, -2, key.c_str());
-            }
-            else if constexpr (std::is_same_v<value_type, std::string>) 
-            {
-                lua_pushstring(L, value.c_str());
-                lua_setfield(L, -2, key.c_str());
-            }
-            else if constexpr (std::is_same_v<value_type, std::shared_ptr<table>>)
-            {
-                value->push_to_lua_state(L);
-                lua_setfield(L, -2, key.c_str());
-            }
-            else throw std::runtime_error("table::push_to_lua_state");
+        if (luaL_loadstring(L, aLuaScript.c_str()) != LUA_OK) return {_error_message(L)};
 
-        }, value);
-        
-        for (const auto &[key, value] : m_BooleanFields) std::visit([L, key](auto &&value)
-        {
-            using value_type = std::decay_t<decltype(value)>;
-            
-            if constexpr (std::is_same_v<value_type, double>)
-            {
-                lua_pushboolean(L, key);
-                lua_pushnumber(L, value);
-                lua_settable(L, -3);
-            }
-            else if constexpr (std::is_same_v<value_type, bool>) 
-            {
-                lua_pushboolean(L, key);
-                lua_pushboolean(L, value);
-                lua_settable(L, -3);
-            }
-            else if constexpr (std::is_same_v<value_type, std::string>) 
-            {
-                lua_pushboolean(L, key);
-                lua_pushstring(L, value.c_str());
-                lua_settable(L, -3);
-            }
-            else if constexpr (std::is_same_v<value_type, std::shared_ptr<table>>)
-            {
-                lua_pushboolean(L, key);
-                value->push_to_lua_state(L);
-                lua_settable(L, -3);
-            }
-            else throw std::runtime_error("table::push_to_lua_state");
-        }, value);
+        if (!_protected_run(L, failure)) return {std::move(failure)};
 
-        //for i in maps, push...)
+        return {};
     }
 
-    table::table(lua_State *L, int aIndex)
+    interpreter::error_type interpreter::validate_syntax(const std::string &aLuaScript) const
     {
-        if (!lua_istable(L, aIndex)) throw std::runtime_error("index must point to a table");
+        auto *L(m_pState.get());
+        const _stack_guard guard(L);
 
-        lua_pushvalue(L, aIndex);
-        
-        lua_pushnil(L);
-        while (lua_next(L, -2))
-        {
-            lua_pushvalue(L, -2);
+        if (luaL_loadstring(L, aLuaScript.c_str()) != LUA_OK) return {_error_message(L)};
 
-            std::variant<std::string, double, bool> key;
+        return {};
+    }
 
-            switch(lua_type(L, -1))
-            {
-                case(LUA_TSTRING):  key = std::string(lua_tostring(L, -1)); break;
-                case(LUA_TNUMBER):  key = lua_tonumber(L, -1); break;
-                case(LUA_TBOOLEAN): key = static_cast<bool>(lua_toboolean(L, -1)); break;
-                default: throw std::runtime_error("table only supports key types of [bool, number, string]");
-            }
+    error::error(std::string_view aMessage) 
+    : m_MessageSize(std::min(aMessage.size(), message_capacity))
+    {
+        std::copy_n(aMessage.data(), m_MessageSize, m_Message.begin());
+    }
 
-            std::visit([L, this](auto &&key)
-            {
-                using key_type = std::decay_t<decltype(key)>;
+    std::string error::message() const
+    {
+        return std::string(m_Message.data(), m_MessageSize);
+    }
 
-                if constexpr (std::is_same_v<key_type, std::string>)
-                {
-                    std::string &fieldName = key;
+    const error::frame_type *error::location() const
+    {
+        for (size_t i(0); i < m_FrameCount; ++i) if (m_Frames[i].line >= 0) return &m_Frames[i];
 
-                    switch(lua_type(L, -2))
-                    {
-                        case(LUA_TSTRING):  m_StringFields[fieldName] = std::string(lua_tostring(L, -2)); break;
-                        case(LUA_TNUMBER):  m_StringFields[fieldName] = lua_tonumber(L, -2); break;
-                        case(LUA_TBOOLEAN): m_StringFields[fieldName] = static_cast<bool>(lua_toboolean(L, -2)); break;
-                        case(LUA_TTABLE):   m_StringFields[fieldName] = std::make_shared<table>(table(L, -2)); break;
-                        default: throw std::runtime_error("table::table: unsupported value type\n");
-                    }
-                }
-                else if constexpr (std::is_same_v<key_type, double>)
-                {
-                    auto &fieldName = key;
+        return nullptr;
+    }
 
-                    switch(lua_type(L, -2))
-                    {
-                        case(LUA_TSTRING):  m_NumberFields[fieldName] = std::string(lua_tostring(L, -2)); break;
-                        case(LUA_TBOOLEAN): m_NumberFields[fieldName] = static_cast<bool>(lua_toboolean(L, -2)); break;
-                        case(LUA_TNUMBER):  m_NumberFields[fieldName] = lua_tonumber(L, -2); break;
-                        case(LUA_TTABLE):   m_NumberFields[fieldName] = std::make_shared<table>(table(L, -2)); break;
-                        default: throw std::runtime_error("table::table: unsupported value type\n");
-                    }
-                }
-                else if constexpr (std::is_same_v<key_type, bool>)
-                {
-                    auto &fieldName = key;
+    std::string error::traceback() const
+    {
+        std::stringstream stream;
 
-                    switch(lua_type(L, -2))
-                    {
-                        case(LUA_TSTRING):  m_BooleanFields[fieldName] = std::string(lua_tostring(L, -2)); break;
-                        case(LUA_TBOOLEAN): m_BooleanFields[fieldName] = static_cast<bool>(lua_toboolean(L, -2)); break;
-                        case(LUA_TNUMBER):  m_BooleanFields[fieldName] = lua_tonumber(L, -2); break;
-                        case(LUA_TTABLE):   m_BooleanFields[fieldName] = std::make_shared<table>(table(L, -2)); break;
-                        default: throw std::runtime_error("table::table: unsupported value type\n");
-                    }
-                }
-            }, key);
+        stream << "stack traceback:";
 
-            lua_pop(L, 2);
+        for (size_t i(0); i < m_FrameCount; ++i)
+        {
+            stream << "\n\t" << m_Frames[i].source.data();
+
+            if (m_Frames[i].line >= 0) stream << ":" << m_Frames[i].line;
         }
 
-        lua_pop(L, 1);
+        return stream.str();
     }
 
-    std::optional<double> interpreter::read_number(const std::string &aPath) const
+    std::ostream &operator<<(std::ostream &stream, const error &a)
     {
-        auto *L(m_pState.get());
-
-        std::optional<double> val;
-
-        if (_read_value(L, aPath) && lua_isnumber(L, -1)) 
-            val = lua_tonumber(L, -1);
-
-        return val;
+        return stream.write(a.m_Message.data(), static_cast<std::streamsize>(a.m_MessageSize));
     }
 
-    std::optional<bool> interpreter::read_boolean(const std::string &aPath) const
+    environment::environment(lua_State *L)
+    : m_pState(L)
     {
-        auto *L(m_pState.get());
+        lua_newtable(L);
 
-        std::optional<bool> val;
+        // _G must not lead back to the shared globals
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "_G");
 
-        if (_read_value(L, aPath) && lua_isboolean(L, -1)) 
-            val = lua_toboolean(L, -1);
+        _push_environment_metatable(L);
+        lua_setmetatable(L, -2);
 
-        return val;
+        m_Reference = luaL_ref(L, LUA_REGISTRYINDEX);
     }
 
-    std::optional<std::string> interpreter::read_string(const std::string &aPath) const
-    {
-        auto *L(m_pState.get());
-
-        std::optional<std::string> val;
+    environment::environment(environment &&aOther) noexcept
+    : m_pState(aOther.m_pState)
+    , m_Reference(std::exchange(aOther.m_Reference, LUA_NOREF))
+    {}
 
-        if (_read_value(L, aPath) && lua_isstring(L, -1))
+    environment &environment::operator=(environment &&aOther) noexcept
+    {
+        if (this != &aOther)
         {
-            size_t len;
-            const char *str = lua_tolstring(L, -1, &len);
+            if (m_Reference != LUA_NOREF) luaL_unref(m_pState, LUA_REGISTRYINDEX, m_Reference);
 
-            std::string msg(str, len);
-            val = msg;
+            m_pState = aOther.m_pState;
+            m_Reference = std::exchange(aOther.m_Reference, LUA_NOREF);
         }
 
-        return val;
+        return *this;
     }
 
-    std::optional<table> interpreter::read_table(const std::string &aPath) const
+    environment::~environment()
     {
-        auto *L = m_pState.get();
-        
-        if (_read_value(L, aPath) && lua_istable(L, -1)) return table(L, -1);
+        if (m_Reference != LUA_NOREF) luaL_unref(m_pState, LUA_REGISTRYINDEX, m_Reference);
+    }
 
-        return {};
+    void environment::write_value(const std::string &aPath, const bool aValue)
+    {
+        const _stack_guard guard(m_pState);
+
+        _write_value(m_pState, aPath, [L = m_pState, aValue]()
+            { lua_pushboolean(L, aValue); }, _push_environment(m_pState, m_Reference));
     }
 
-    void interpreter::write_value(const std::string &aPath, const bool aValue)
+    void environment::write_value(const std::string &aPath, const double aValue)
     {
-        _write_value(m_pState.get(), aPath, [L = m_pState.get(), aValue]()
-            { lua_pushboolean(L, aValue); });
+        const _stack_guard guard(m_pState);
+
+        _write_value(m_pState, aPath, [L = m_pState, aValue]()
+            { lua_pushnumber(L, aValue); }, _push_environment(m_pState, m_Reference));
     }
 
-    void interpreter::write_value(const std::string &aPath, const double aValue)
+    void environment::write_value(const std::string &aPath, const std::string &aValue)
     {
-        _write_value(m_pState.get(), aPath, [L = m_pState.get(), aValue]()
-            { lua_pushnumber(L, aValue); });
+        const _stack_guard guard(m_pState);
+
+        _write_value(m_pState, aPath, [L = m_pState, &aValue]()
+            { lua_pushstring(L, aValue.c_str()); }, _push_environment(m_pState, m_Reference));
     }
 
-    void interpreter::write_value(const std::string &aPath, const std::string &aValue)
+    void environment::write_value(const std::string &aPath, const std::string::value_type *aValue)
     {
-        _write_value(m_pState.get(), aPath, [L = m_pState.get(), &aValue]()
-            { lua_pushstring(L, aValue.c_str()); });
+        const _stack_guard guard(m_pState);
+
+        _write_value(m_pState, aPath, [L = m_pState, &aValue]()
+            { lua_pushstring(L, aValue); }, _push_environment(m_pState, m_Reference));
     }
 
-    void interpreter::write_value(const std::string &aPath, const std::string::value_type *aValue)
+    void environment::write_value(const std::string &aPath, const table &aValue)
     {
-        _write_value(m_pState.get(), aPath, [L = m_pState.get(), &aValue]()
-            { lua_pushstring(L, aValue); });
+        const _stack_guard guard(m_pState);
+
+        _write_value(m_pState, aPath, [L = m_pState, &aValue]()
+            { aValue.push_to_lua_state(L); }, _push_environment(m_pState, m_Reference));
     }
 
-    void interpreter::write_value(const std::string &aPath, const table &aValue)
+    void environment::write_value(const std::string &aPath, const std::shared_ptr<const shared_table> &aValue)
     {
-        _write_value(m_pState.get(), aPath, [L = m_pState.get(), &aValue]()
-            { aValue.push_to_lua_state(L); });
+        const _stack_guard guard(m_pState);
+
+        _write_value(m_pState, aPath, [L = m_pState, &aValue]()
+            { shared_table::push_to_lua_state(L, aValue); }, _push_environment(m_pState, m_Reference));
     }
 
-    void interpreter::register_function(const std::string &aName, closure_type aClosure)
+    void environment::write_values(const interpreter::write_batch &aBatch)
     {
-        m_RegisteredClosures[aName] = aClosure;
+        const _stack_guard guard(m_pState);
 
-        auto wrapper = [](lua_State *p)
-        {
-            auto *pImpl = static_cast<decltype(m_RegisteredClosures)::mapped_type *>(
-                lua_touserdata(p, lua_upvalueindex(1)));
+        _write_values(m_pState, aBatch.m_Writes, _push_environment(m_pState, m_Reference));
+    }
 
-            params_type args;
+    std::optional<bool> environment::read_boolean(const std::string &aPath) const
+    {
+        const _stack_guard guard(m_pState);
 
-            for (size_t i(1); i < 1 + lua_gettop(p); ++i)
-            {
-                if (lua_isnumber(p, i)) args.push_back(lua_tonumber(p, i));
-                else if (lua_isboolean(p, i)) args.push_back(static_cast<bool>(lua_toboolean(p, i)));
-                else if (lua_isstring(p, i))
-                {
-                    size_t len;
-                    const char *str = lua_tolstring(p, i, &len);
+        return _read_boolean(m_pState, aPath, _push_environment(m_pState, m_Reference));
+    }
 
-                    args.push_back(std::string(str, len));
-                }
-                else if (lua_istable(p, i)) args.push_back(table(p, i));
-                else throw std::runtime_error("unsupported parameter type");
-            }
+    std::optional<double> environment::read_number(const std::string &aPath) const
+    {
+        const _stack_guard guard(m_pState);
 
-            auto return_values = (*pImpl)(args);
+        return _read_number(m_pState, aPath, _push_environment(m_pState, m_Reference));
+    }
 
-            for (const auto &val : return_values) std::visit([&p](auto &&val)
-            {
-                using return_type = std::decay_t<decltype(val)>;
-                
-                if constexpr (std::is_same_v<return_type, double>) lua_pushnumber(p, val);        
-                else if constexpr (std::is_same_v<return_type, bool>) lua_pushboolean(p, val);        
-                else if constexpr (std::is_same_v<return_type, std::string>) lua_pushstring(p, val.c_str());        
-                else if constexpr (std::is_same_v<return_type, table>) val.push_to_lua_state(p);
-                else throw std::runtime_error("unsupported return type");
-            }, val);
-
-            return static_cast<int>(return_values.size());
-        };
+    std::optional<std::string> environment::read_string(const std::string &aPath) const
+    {
+        const _stack_guard guard(m_pState);
 
-        _write_value(m_pState.get(), aName, [L = m_pState.get(), &aName, wrapper, this]()
-        { 
-            lua_pushlightuserdata(L, &(this->m_RegisteredClosures[aName]));
-            lua_pushcclosure(L, wrapper, 1); 
-        });
+        return _read_string(m_pState, aPath, _push_environment(m_pState, m_Reference));
     }
 
-    interpreter::interpreter() : m_pState(luaL_newstate(), [](lua_State *p){lua_close(p);}) {}
+    std::optional<table> environment::read_table(const std::string &aPath) const
+    {
+        const _stack_guard guard(m_pState);
 
-    interpreter::error_type interpreter::run(const std::string &aLuaScript) const
+        return _read_table(m_pState, aPath, _push_environment(m_pState, m_Reference));
+    }
+
+    std::vector<std::optional<environment::value_type>> environment::read_values(const std::vector<std::string> &aPaths) const
     {
-        switch (const auto status = luaL_dostring(m_pState.get(), aLuaScript.c_str()))
-        {
-            case LUA_OK: return {};
-            default: return {lua_tostring(m_pState.get(), -1)};
-        }
+        const _stack_guard guard(m_pState);
+
+        return _read_values(m_pState, aPaths, _push_environment(m_pState, m_Reference));
     }
 
-    interpreter::error_type interpreter::validate_syntax(const std::string &aLuaScript) const
+    environment::error_type environment::run(const std::string &aLuaScript) const
     {
-        switch (const auto status = luaL_loadstring(m_pState.get(), aLuaScript.c_str()))
-        {
-            case LUA_OK: 
-            {
-                lua_pop(m_pState.get(), 1);
+        auto *L(m_pState);
+        const _stack_guard guard(L);
 
-                return {};
-            }
+        error failure{std::string_view()};
 
-            default: return {lua_tostring(m_pState.get(), -1)};
-        }
+        // the script runs on a thread whose globals are the environment, so that the functions it loads
+        // and getfenv(0) stay in the environment; the thread is collected once the guard pops it
+        lua_State *T(lua_newthread(L));
+        lua_rawgeti(T, LUA_REGISTRYINDEX, m_Reference);
+        lua_replace(T, LUA_GLOBALSINDEX);
+
+        if (luaL_loadstring(T, aLuaScript.c_str()) != LUA_OK) return {_error_message(T)};
+
+        if (!_protected_run(T, failure)) return {std::move(failure)};
+
+        return {};
     }
 }
-
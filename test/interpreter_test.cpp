@@ -5,6 +5,8 @@
 
 #include <jfc/lua.h>
 
+#include <stdexcept>
+
 using namespace jfc::lua;
 
 /*static const std::string script((R"V0G0N(
@@ -30,5 +32,344 @@ TEST_CASE( "jfc::lua::interpreter_test", "[jfc::lua::interpreter]" )
 
         REQUIRE(error.has_value());
     }
-}
 
+    SECTION("read_values reads many paths in one call")
+    {
+        interpreter interp;
+
+        REQUIRE(!interp.run("config = { window = { width = 640, title = 'demo' }, vsync = true }").has_value());
+
+        auto values = interp.read_values({ "config.window.width", "config.missing.value", "config.vsync",
+            "config.window.title" });
+
+        REQUIRE(values.size() == 4);
+        REQUIRE(std::get<double>(*values[0]) == 640);
+        REQUIRE(!values[1].has_value());
+        REQUIRE(std::get<bool>(*values[2]));
+        REQUIRE(std::get<std::string>(*values[3]) == "demo");
+    }
+
+    SECTION("numeric path segments reach array elements")
+    {
+        interpreter interp;
+
+        REQUIRE(!interp.run("items = { { name = 'sword' }, { name = 'shield' } }").has_value());
+
+        REQUIRE(interp.read_string("items.1.name") == "sword");
+        REQUIRE(std::get<std::string>(*interp.read_values({ "items.2.name" })[0]) == "shield");
+
+        interp.write_value("items.2.name", "buckler");
+
+        REQUIRE(!interp.run("name = items[2].name missing = items['2'] == nil").has_value());
+        REQUIRE(interp.read_string("name") == "buckler");
+        REQUIRE(interp.read_boolean("missing") == true);
+        REQUIRE(!interp.read_string("items.01.name").has_value());
+    }
+
+    SECTION("write_values applies a batch in insertion order")
+    {
+        interpreter interp;
+
+        interpreter::write_batch batch;
+        batch.write_value("a.b.number", 1.)
+            .write_value("a.b", 2.)
+            .write_value("a.c.string", "hello")
+            .write_value("flag", true);
+
+        interp.write_values(batch);
+
+        REQUIRE(interp.read_number("a.b") == 2.);
+        REQUIRE(interp.read_string("a.c.string") == "hello");
+        REQUIRE(interp.read_boolean("flag") == true);
+    }
+
+    SECTION("watched tables record assigned fields until drained")
+    {
+        interpreter interp;
+
+        REQUIRE(!interp.run("player = { health = 10, name = 'bob' }").has_value());
+        REQUIRE(!interp.watch("player").has_value());
+
+        REQUIRE(!interp.run("player.health = player.health - 1").has_value());
+        REQUIRE(interp.read_number("player.health") == 9.);
+
+        auto dirty = interp.drain_dirty();
+        REQUIRE(dirty.size() == 1);
+        REQUIRE(dirty[0] == "player.health");
+        REQUIRE(interp.drain_dirty().empty());
+
+        interp.unwatch("player");
+        REQUIRE(!interp.run("player.name = 'alice'").has_value());
+        REQUIRE(interp.drain_dirty().empty());
+        REQUIRE(!interp.run("name = player.name").has_value());
+        REQUIRE(interp.read_string("name") == "alice");
+    }
+
+    SECTION("watch reports assignments to a callback if one is provided")
+    {
+        interpreter interp;
+
+        std::vector<std::string> changed;
+
+        REQUIRE(!interp.run("settings = {}").has_value());
+        REQUIRE(!interp.watch("settings", [&changed](const std::string &aPath) { changed.push_back(aPath); }).has_value());
+        REQUIRE(interp.watch("missing").has_value());
+
+        REQUIRE(!interp.run("settings.volume = 5").has_value());
+
+        REQUIRE(changed.size() == 1);
+        REQUIRE(changed[0] == "settings.volume");
+        REQUIRE(interp.drain_dirty().empty());
+    }
+
+    SECTION("a callback throwing on a write from c++ throws out of the write")
+    {
+        interpreter interp;
+
+        REQUIRE(!interp.run("settings = {}").has_value());
+        REQUIRE(!interp.watch("settings", [](const std::string &aPath) { throw std::runtime_error("rejected " + aPath); }).has_value());
+
+        REQUIRE_THROWS_AS(interp.write_value("settings.volume", 5.), std::runtime_error);
+        REQUIRE_THROWS(interp.write_value("settings.audio.volume", 5.));
+        REQUIRE_THROWS(interp.write_values(interpreter::write_batch().write_value("settings.muted", true)));
+
+        REQUIRE(interp.read_number("settings.volume") == 5.);
+        REQUIRE(!interp.run("ok = true").has_value());
+        REQUIRE(interp.read_boolean("ok") == true);
+    }
+
+    SECTION("watch fails for tables it cannot track")
+    {
+        interpreter interp;
+
+        REQUIRE(!interp.run("settings = {} alias = settings").has_value());
+        REQUIRE(!interp.watch("settings").has_value());
+
+        bool called(false);
+        REQUIRE(interp.watch("alias", [&called](const std::string &) { called = true; }).has_value());
+
+        REQUIRE(!interp.run("alias.volume = 5").has_value());
+        REQUIRE(!called);
+        REQUIRE(interp.drain_dirty() == std::vector<std::string>{ "settings.volume" });
+    }
+
+    SECTION("environments share the interpreter's globals but not each other's")
+    {
+        interpreter interp;
+
+        interp.write_value("shared.greeting", "hello");
+
+        auto first = interp.create_environment();
+        auto second = interp.create_environment();
+
+        REQUIRE(!first.run("tenant = 'first' greeting = shared.greeting").has_value());
+        REQUIRE(!second.run("tenant = 'second' _G.escaped = true").has_value());
+
+        REQUIRE(first.read_string("tenant") == "first");
+        REQUIRE(first.read_string("greeting") == "hello");
+        REQUIRE(second.read_string("tenant") == "second");
+        REQUIRE(!second.read_string("greeting").has_value());
+
+        REQUIRE(!interp.read_string("tenant").has_value());
+        REQUIRE(!interp.read_boolean("escaped").has_value());
+
+        first.write_value("shared.greeting", "shadowed");
+        REQUIRE(first.read_string("shared.greeting") == "shadowed");
+        REQUIRE(interp.read_string("shared.greeting") == "hello");
+    }
+
+    SECTION("environments cannot modify state shared with other environments")
+    {
+        interpreter::options options;
+        options.libraries = { interpreter::library::base, interpreter::library::string };
+
+        interpreter interp(options);
+
+        interp.write_value("shared.greeting", "hello");
+
+        auto first = interp.create_environment();
+        auto second = interp.create_environment();
+
+        REQUIRE(first.run("shared.greeting = 'changed'").has_value());
+        REQUIRE(first.run("string.format = nil").has_value());
+        REQUIRE(first.run("getmetatable(_G).__index = { shared = { greeting = 'redirected' } }").has_value());
+        REQUIRE(first.run("setmetatable(_G, nil)").has_value());
+        REQUIRE(!first.run("shared = { greeting = 'own' }").has_value());
+
+        REQUIRE(!second.run("greeting = shared.greeting formatted = string.format('%d', 7)").has_value());
+        REQUIRE(second.read_string("greeting") == "hello");
+        REQUIRE(second.read_string("formatted") == "7");
+        REQUIRE(first.read_string("shared.greeting") == "own");
+        REQUIRE(interp.read_string("shared.greeting") == "hello");
+    }
+
+    SECTION("environments cannot reach the interpreter's globals through the base library")
+    {
+        interpreter::options options;
+        options.libraries = { interpreter::library::base, interpreter::library::table };
+        options.lazy_libraries = { interpreter::library::string };
+
+        interpreter interp(options);
+
+        REQUIRE(!interp.run("shared = { 'a', 'b', nested = { 1 } } function shared_function() return 1 end").has_value());
+
+        auto first = interp.create_environment();
+        auto second = interp.create_environment();
+
+        REQUIRE(!first.run("formatted = string.format('%d', 1)").has_value());
+        REQUIRE(first.run("getmetatable('').__index.format = nil").has_value());
+        REQUIRE(first.run("setfenv(shared_function, {})").has_value());
+        REQUIRE(first.run("setfenv(print, {})").has_value());
+        REQUIRE(!first.run("getfenv(0).leak = 1 getfenv(print).leak = 2 getfenv().leak = 3 loadstring('loaded = 4')()").has_value());
+        REQUIRE(!first.run("local f = function() return leak end setfenv(f, { leak = 5 }) own = f()").has_value());
+
+        REQUIRE(first.read_number("leak") == 3.);
+        REQUIRE(first.read_number("loaded") == 4.);
+        REQUIRE(first.read_number("own") == 5.);
+        REQUIRE(!interp.read_number("leak").has_value());
+        REQUIRE(!interp.read_number("loaded").has_value());
+        REQUIRE(!second.run("leaked = leak formatted = string.format('%d', 7)").has_value());
+        REQUIRE(!second.read_number("leaked").has_value());
+        REQUIRE(second.read_string("formatted") == "7");
+
+        REQUIRE(!first.run(R"(
+            kind = type(shared) .. ' ' .. type(shared.nested)
+            joined = table.concat(shared, ',')
+            values = ''
+            for i, v in ipairs(shared) do values = values .. v end
+            count = 0
+            for k, v in pairs(shared) do count = count + 1 end
+            first_value = unpack(shared)
+            visible = getmetatable(shared) == false and next(shared) ~= nil
+        )").has_value());
+
+        REQUIRE(first.read_string("kind") == "table table");
+        REQUIRE(first.read_string("joined") == "a,b");
+        REQUIRE(first.read_string("values") == "ab");
+        REQUIRE(first.read_number("count") == 3.);
+        REQUIRE(first.read_string("first_value") == "a");
+        REQUIRE(first.read_boolean("visible") == true);
+    }
+
+    SECTION("memoized functions only run for arguments they have not seen")
+    {
+        interpreter interp;
+
+        REQUIRE(!interp.run("calls = 0 rules = {} function rules.price(a, b) calls = calls + 1 return a * b end").has_value());
+
+        interp.memoize("rules.price", 2);
+
+        REQUIRE(interp.call_function("rules.price", { 2., 3. }) == params_type{ 6. });
+        REQUIRE(interp.call_function("rules.price", { 2., 3. }) == params_type{ 6. });
+        REQUIRE(interp.call_function("rules.price", { 4., 3. }) == params_type{ 12. });
+        REQUIRE(interp.read_number("calls") == 2.);
+
+        REQUIRE(interp.memo_statistics("rules.price")->hits == 1);
+        REQUIRE(interp.memo_statistics("rules.price")->misses == 2);
+
+        REQUIRE(!interp.run("function rules.price(a, b) return a + b end").has_value());
+        REQUIRE(interp.call_function("rules.price", { 2., 3. }) == params_type{ 5. });
+        REQUIRE(interp.memo_statistics("rules.price")->invalidations == 1);
+
+        interpreter::error_type error;
+
+        REQUIRE(!interp.call_function("rules.missing", {}, &error).has_value());
+        REQUIRE(!error.has_value());
+
+        REQUIRE(!interp.run("function rules.fail() error_raised_here() end").has_value());
+        REQUIRE(!interp.call_function("rules.fail", {}, &error).has_value());
+        REQUIRE(error.has_value());
+        REQUIRE(error->message().find("error_raised_here") != std::string::npos);
+
+        error.reset();
+
+        REQUIRE(!interp.run("function rules.callbacks() return { f = function() end } end").has_value());
+        REQUIRE(!interp.call_function("rules.callbacks", {}, &error).has_value());
+        REQUIRE(error.has_value());
+        REQUIRE(error->message().find("unsupported") != std::string::npos);
+    }
+
+    SECTION("options choose which libraries are opened, and when")
+    {
+        interpreter::options options;
+        options.libraries = { interpreter::library::base, interpreter::library::string };
+        options.lazy_libraries = { interpreter::library::math, interpreter::library::io };
+        options.preload = { { "config", "return { value = 42 }" } };
+
+        interpreter interp(options);
+
+        REQUIRE(!interp.run(R"(
+            has_string = type(string) == 'table'
+            has_os = os ~= nil
+            floor = math.floor(2.5)
+            value = require('config').value
+        )").has_value());
+
+        REQUIRE(interp.read_boolean("has_string") == true);
+        REQUIRE(interp.read_boolean("has_os") == false);
+        REQUIRE(interp.read_number("floor") == 2.);
+        REQUIRE(interp.read_number("value") == 42.);
+
+        interpreter::options lazyString;
+        lazyString.lazy_libraries = { interpreter::library::string };
+
+        interpreter lazy(lazyString);
+
+        REQUIRE(!lazy.run("upper = ('abc'):upper() formatted = ('%d'):format(7)").has_value());
+        REQUIRE(lazy.read_string("upper") == "ABC");
+        REQUIRE(lazy.read_string("formatted") == "7");
+
+        interpreter bare;
+
+        REQUIRE(bare.run("x = type(1)").has_value());
+        REQUIRE(bare.memory_usage() < interp.memory_usage());
+    }
+
+    SECTION("exceptions thrown by registered functions become lua errors")
+    {
+        interpreter interp;
+
+        interp.register_function("validate", [](params_type) -> params_type
+        {
+            throw std::invalid_argument("value out of range");
+        });
+
+        for (int i(0); i < 100; ++i)
+        {
+            auto error = interp.run("local x = 1\nvalidate(x)");
+
+            REQUIRE(error.has_value());
+            REQUIRE(error->message().find("value out of range") != std::string::npos);
+            REQUIRE(error->location() != nullptr);
+            REQUIRE(error->location()->line == 2);
+            REQUIRE(error->traceback().find(":2") != std::string::npos);
+        }
+
+        REQUIRE(!interp.run("ok = true").has_value());
+        REQUIRE(interp.read_boolean("ok") == true);
+
+        REQUIRE(!interp.run("watched = {}").has_value());
+        REQUIRE(!interp.watch("watched").has_value());
+
+        auto error = interp.run("watched[0/0] = 1");
+
+        REQUIRE(error.has_value());
+        REQUIRE(error->message().find("NaN") != std::string::npos);
+
+        error = interp.run("x = " + std::string(jfc::lua::error::message_capacity, 'x') + ".y");
+
+        REQUIRE(error.has_value());
+        REQUIRE(error->message().size() == jfc::lua::error::message_capacity);
+    }
+
+    SECTION("syntax errors have a message but no recorded frames")
+    {
+        interpreter interp;
+
+        auto error = interp.validate_syntax("x = = 1");
+
+        REQUIRE(error.has_value());
+        REQUIRE(!error->message().empty());
+        REQUIRE(error->location() == nullptr);
+    }
+}
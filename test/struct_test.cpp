@@ -0,0 +1,96 @@
+// © Joseph Cameron - All Rights Reserved
+
+#include <jfc/catch.hpp>
+#include <jfc/types.h>
+
+#include <jfc/lua.h>
+
+using namespace jfc::lua;
+
+struct vec2
+{
+    double x, y;
+};
+
+struct path
+{
+    std::string name;
+    int id;
+    bool closed;
+    std::vector<vec2> points;
+};
+
+template<> struct jfc::lua::struct_fields<vec2>
+{
+    static constexpr auto value = std::make_tuple(JFC_LUA_FIELD(vec2, x), JFC_LUA_FIELD(vec2, y));
+};
+
+template<> struct jfc::lua::struct_fields<path>
+{
+    static constexpr auto value = std::make_tuple(
+        JFC_LUA_FIELD(path, name),
+        JFC_LUA_FIELD(path, id),
+        make_field("is_closed", &path::closed),
+        JFC_LUA_FIELD(path, points));
+};
+
+TEST_CASE( "jfc::lua::struct_test", "[jfc::lua::struct_fields]" )
+{
+    SECTION("a struct written to lua can be read back")
+    {
+        interpreter interp;
+
+        const path written{ "triangle", 3, true, { {0, 0}, {1, 0}, {0, 1} } };
+
+        interp.write_struct("shapes.triangle", written);
+
+        REQUIRE(!interp.run("ok = #shapes.triangle.points == 3 and shapes.triangle.is_closed").has_value());
+        REQUIRE(interp.read_boolean("ok") == true);
+
+        auto read = interp.read_struct<path>("shapes.triangle");
+
+        REQUIRE(read.has_value());
+        REQUIRE(read->name == "triangle");
+        REQUIRE(read->id == 3);
+        REQUIRE(read->closed);
+        REQUIRE(read->points.size() == 3);
+        REQUIRE(read->points[2].y == 1);
+    }
+
+    SECTION("reading a struct fails if a field is missing or the wrong type")
+    {
+        interpreter interp;
+
+        REQUIRE(!interp.run("a = { x = 1 } b = { x = 1, y = 'two' }").has_value());
+
+        REQUIRE(!interp.read_struct<vec2>("a").has_value());
+        REQUIRE(!interp.read_struct<vec2>("b").has_value());
+        REQUIRE(!interp.read_struct<vec2>("c").has_value());
+    }
+
+    SECTION("integral members only accept whole numbers in range")
+    {
+        interpreter interp;
+
+        REQUIRE(!interp.run(R"(
+            fraction = { name = 'a', id = 1.5, is_closed = true, points = {} }
+            large = { name = 'b', id = 4294967296, is_closed = true, points = {} }
+            nan = { name = 'c', id = 0/0, is_closed = true, points = {} }
+            whole = { name = 'd', id = -7, is_closed = true, points = {} }
+        )").has_value());
+
+        REQUIRE(!interp.read_struct<path>("fraction").has_value());
+        REQUIRE(!interp.read_struct<path>("large").has_value());
+        REQUIRE(!interp.read_struct<path>("nan").has_value());
+        REQUIRE(interp.read_struct<path>("whole")->id == -7);
+    }
+
+    SECTION("vectors of booleans can be written and read")
+    {
+        interpreter interp;
+
+        interp.write_struct("flags", std::vector<bool>{ true, false, true });
+
+        REQUIRE(interp.read_struct<std::vector<bool>>("flags") == std::vector<bool>{ true, false, true });
+    }
+}
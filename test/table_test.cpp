@@ -5,6 +5,8 @@
 
 #include <jfc/lua.h>
 
+#include <sstream>
+
 using namespace jfc::lua;
 
 TEST_CASE( "jfc::lua::table_test", "[jfc::lua::table]" )
@@ -13,5 +15,126 @@ TEST_CASE( "jfc::lua::table_test", "[jfc::lua::table]" )
     {
         REQUIRE(true);
     }
-}
 
+    SECTION("a shared_table is readable from every interpreter it is written to")
+    {
+        interpreter source;
+
+        REQUIRE(!source.run("items = { 'sword', 'shield', [10] = 'ten', price = { sword = 5 }, [true] = 'yes' }").has_value());
+
+        const auto items = std::make_shared<const shared_table>(*source.read_table("items"));
+
+        interpreter first, second;
+
+        first.write_value("catalog", items);
+        second.write_value("data.catalog", items);
+
+        REQUIRE(!first.run(R"(
+            sequence = catalog[1] == 'sword' and catalog[2] == 'shield' and catalog[3] == nil and #catalog == 2
+            keys = catalog[10] == 'ten' and catalog[true] == 'yes'
+            nested = catalog.price.sword == 5 and catalog.price == catalog.price
+            count = 0
+            for k, v in catalog() do count = count + 1 end
+        )").has_value());
+
+        REQUIRE(first.read_boolean("sequence") == true);
+        REQUIRE(first.read_boolean("keys") == true);
+        REQUIRE(first.read_boolean("nested") == true);
+        REQUIRE(first.read_number("count") == 5.);
+
+        REQUIRE(!second.run("first = data.catalog[1]").has_value());
+        REQUIRE(second.read_string("first") == "sword");
+        REQUIRE(second.run("data.catalog.price = 1").has_value());
+    }
+
+    SECTION("paths read through a shared_table, but writes into one are refused")
+    {
+        interpreter source;
+
+        REQUIRE(!source.run("items = { price = { sword = 5 }, name = 'armory' }").has_value());
+
+        const auto items = std::make_shared<const shared_table>(*source.read_table("items"));
+
+        interpreter interp;
+        interp.write_value("catalog", items);
+
+        REQUIRE(interp.read_number("catalog.price.sword") == 5.);
+        REQUIRE(std::get<std::string>(*interp.read_values({ "catalog.name" })[0]) == "armory");
+
+        REQUIRE_THROWS(interp.write_value("catalog.x", 1.));
+        REQUIRE_THROWS(interp.write_values(interpreter::write_batch().write_value("catalog.price.axe", 3.)));
+
+        REQUIRE(interp.read_number("catalog.price.sword") == 5.);
+        REQUIRE(!interp.run("ok = catalog.price.sword == 5").has_value());
+        REQUIRE(interp.read_boolean("ok") == true);
+    }
+
+    SECTION("subtables of a shared_table keep it alive without copying its shared_ptr")
+    {
+        interpreter source;
+
+        REQUIRE(!source.run("items = { price = { sword = 5 } }").has_value());
+
+        auto items = std::make_shared<const shared_table>(*source.read_table("items"));
+        const std::weak_ptr<const shared_table> weak(items);
+
+        interpreter::options options;
+        options.libraries = { interpreter::library::base };
+
+        interpreter interp(options);
+        interp.write_value("catalog", items);
+        items.reset();
+
+        REQUIRE(weak.use_count() == 1);
+        REQUIRE(!interp.run("price = catalog.price for i = 1, 100 do local p = catalog.price end").has_value());
+        REQUIRE(weak.use_count() == 1);
+
+        REQUIRE(!interp.run("catalog = nil collectgarbage()").has_value());
+        REQUIRE(!weak.expired());
+        REQUIRE(interp.read_number("price.sword") == 5.);
+
+        REQUIRE(!interp.run("price = nil collectgarbage()").has_value());
+        REQUIRE(weak.expired());
+    }
+
+    SECTION("tables read with a pool share identical subtables")
+    {
+        interpreter interp;
+
+        REQUIRE(!interp.run(R"(
+            items = { { "nothing" }, { "nothing" }, { "nothing", nested = { 1 } }, { "nothing", nested = { 1 } } }
+            other = { { "nothing" } }
+        )").has_value());
+
+        table_pool pool;
+
+        auto items = interp.read_table("items", pool);
+        auto other = interp.read_table("other", pool);
+        auto unpooled = interp.read_table("items");
+
+        REQUIRE(pool.size() == 3);
+        REQUIRE(*items == *unpooled);
+        REQUIRE(items->hash() == unpooled->hash());
+        REQUIRE(*items != *other);
+    }
+
+    SECTION("to_string on many threads matches operator<<")
+    {
+        interpreter interp;
+
+        REQUIRE(!interp.run(R"(
+            dump = { name = "state", [true] = 1, [0.5] = "half" }
+            for i = 1, 5000 do dump[i] = { i, "item", nested = { i * 0.25 } } end
+            dump.big = {}
+            for i = 1, 5000 do dump.big["key" .. i] = i end
+        )").has_value());
+
+        auto dump = interp.read_table("dump");
+
+        std::stringstream stream;
+        stream << *dump;
+
+        REQUIRE(dump->to_string(1) == stream.str());
+        REQUIRE(dump->to_string(4) == stream.str());
+    }
+}